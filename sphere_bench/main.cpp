@@ -0,0 +1,475 @@
+// CPU microbenchmarks for the sphere simulation and upload stages, no
+// renderer or GPU needed. Every kernel is swept over sphere counts and thread
+// counts and reported as ns per sphere and GB/s of nominal memory traffic.
+//
+// sphere_bench [--filter text] [--min-time seconds] [--csv path]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <OS/Interfaces/IMemory.h>
+#include <OS/Interfaces/IThread.h>
+#include <OS/Interfaces/ITime.h>
+
+#include <OS/Core/ThreadSystem.h>
+
+#include "sphere_grid.h"
+#include "sphere_sim.h"
+#include "sphere_sort.h"
+
+constexpr uint32_t gBenchSphereCounts[] = {16 * 1024, 128 * 1024,
+                                           1024 * 1024};
+constexpr uint32_t gBenchGrainSize = 1024;
+constexpr float gBenchDeltaZ = 500.0f / 60.0f;
+constexpr uint32_t gBenchSeed = 0x5eed;
+// Same view as the app at startup, on a 1080p target.
+constexpr float gBenchHorizontalFov = 120.0f * PI / 180.0f;
+constexpr uint32_t gBenchWidth = 1920;
+constexpr uint32_t gBenchHeight = 1080;
+constexpr uint32_t gBenchRayCount = 16;
+
+// Array-of-structures layout the update kernels can be compared against.
+struct SphereAos {
+  float mX;
+  float mY;
+  float mZ;
+  uint32_t mColor;
+};
+
+struct BenchContext {
+  ThreadSystem *pThreads;
+  uint32_t mCount;
+  uint32_t mThreadCount;
+  SphereFrame mFrame;
+  SphereStep mStep;
+  BackgroundParallelFor mStepJob;
+  SphereAos *pAos;
+  uint32_t mVisibleCount;
+  uint32_t mLodVisibleCount[gSphereLodCount];
+  uint32_t mLodInstanceOffset[gSphereLodCount];
+  // The grid benchmarks have a state of their own, so the grid stays in step
+  // with it whatever the other benchmarks do.
+  SphereState mGridState;
+  SphereGrid mGrid;
+  uint32_t *pGridVisible;
+  float3 mRayDirs[gBenchRayCount];
+  // Sort keys are only filled in once, by the setup, so cull and frame time
+  // the classification the app does without sorting.
+  uint16_t *pSphereDepth;
+  RadixSortScratch mSortScratch;
+};
+
+// respawnSphereScalar for the AoS layout.
+static void respawnSphereAos(SphereAos &sphere, uint32_t i, uint32_t seed,
+                             uint32_t frame) {
+  uint32_t key = sphereRandomKey(seed, i, frame);
+  float cosTheta =
+      unitFloat(sphereRandom(key, RANDOM_STREAM_COS_THETA)) * 2.0f - 1.0f;
+  float sinTheta = sqrtf(1.0f - cosTheta * cosTheta);
+  float phi = unitFloat(sphereRandom(key, RANDOM_STREAM_PHI)) - 0.5f;
+  float r0 = unitFloat(sphereRandom(key, RANDOM_STREAM_RADIUS0));
+  float r1 = unitFloat(sphereRandom(key, RANDOM_STREAM_RADIUS1));
+  float r2 = unitFloat(sphereRandom(key, RANDOM_STREAM_RADIUS2));
+  float r = r0 > r1 ? r0 : r1;
+  r = r > r2 ? r : r2;
+  r = r * gSpawnRadius;
+
+  float rSinTheta = r * sinTheta;
+  sphere.mX = rSinTheta * cosTurns(phi);
+  sphere.mY = rSinTheta * sinTurns(phi);
+  sphere.mZ = r * cosTheta + gSpawnDistance;
+  sphere.mColor = sphereRandom(key, RANDOM_STREAM_COLOR) | 0xff000000u;
+}
+
+static void updateAosRange(void *pData, uint32_t begin, uint32_t end) {
+  auto pContext = static_cast<BenchContext *>(pData);
+  const SphereFrame &frame = pContext->mFrame;
+  for (uint32_t i = begin; i < end; ++i) {
+    SphereAos &sphere = pContext->pAos[i];
+    if (sphere.mZ < 0)
+      respawnSphereAos(sphere, i, frame.mSeed, frame.mFrame);
+    else
+      sphere.mZ -= frame.mDeltaZ;
+  }
+}
+
+static void updateSoaRange(void *pData, uint32_t begin, uint32_t end) {
+  auto pContext = static_cast<BenchContext *>(pData);
+  const SphereFrame &frame = pContext->mFrame;
+  updateSpheres(frame.mState, begin, end, frame.mDeltaZ, frame.mSeed,
+                frame.mFrame, frame.mSimd);
+}
+
+static void runParallel(BenchContext &context, RangeTaskFunc pTask,
+                        void *pData) {
+  parallelFor(context.pThreads, pTask, pData, context.mCount, gBenchGrainSize,
+              context.mThreadCount);
+}
+
+static void benchUpdateSoaScalar(BenchContext &context) {
+  context.mFrame.mSimd = false;
+  runParallel(context, updateSoaRange, &context);
+}
+
+static void benchUpdateSoaSimd(BenchContext &context) {
+  context.mFrame.mSimd = true;
+  runParallel(context, updateSoaRange, &context);
+}
+
+static void benchUpdateAosScalar(BenchContext &context) {
+  runParallel(context, updateAosRange, &context);
+}
+
+// Out-of-place update as used by the pipelined frame loop. Swaps the states
+// so every iteration steps from the latest one.
+static void benchStepSoaSimd(BenchContext &context) {
+  SphereStep &step = context.mStep;
+  step.mSrc = context.mFrame.mState;
+  step.mFrame = context.mFrame.mFrame;
+  runParallel(context, stepSphereRange, &step);
+  context.mFrame.mState = step.mDst;
+  step.mDst = step.mSrc;
+}
+
+static void benchCull(BenchContext &context) {
+  runParallel(context, cullSphereFrameRange, &context.mFrame);
+}
+
+static void benchFrame(BenchContext &context) {
+  context.mFrame.mSimd = true;
+  runParallel(context, updateSphereFrameRange, &context.mFrame);
+}
+
+// The serial offset pass plus the streamed instance writes, from the state
+// the last cull or frame classified.
+static void benchWrite(BenchContext &context) {
+  const SphereFrame &frame = context.mFrame;
+  context.mVisibleCount = countVisibleSpheres(
+      frame.pBlockLodCount, context.mCount, context.mLodVisibleCount,
+      context.mLodInstanceOffset, frame.pBlockLodOffset);
+  runParallel(context, writeSphereFrameRange, &context.mFrame);
+}
+
+// Front-to-back ordering: the serial offset pass, the sort key writes and the
+// per-LOD radix sorts.
+static void benchSort(BenchContext &context) {
+  SphereFrame &frame = context.mFrame;
+  context.mVisibleCount = countVisibleSpheres(
+      frame.pBlockLodCount, context.mCount, context.mLodVisibleCount,
+      context.mLodInstanceOffset, frame.pBlockLodOffset);
+  frame.pSphereDepth = context.pSphereDepth;
+  runParallel(context, writeSphereSortKeyRange, &frame);
+  frame.pSphereDepth = nullptr;
+  sortVisibleSpheres(context.pThreads, frame, context.mLodVisibleCount,
+                     context.mLodInstanceOffset, context.mSortScratch,
+                     context.mThreadCount);
+}
+
+// The instance writes in the order the last sort left.
+static void benchWriteSorted(BenchContext &context) {
+  parallelFor(context.pThreads, writeSortedSphereFrameRange, &context.mFrame,
+              context.mVisibleCount, gBenchGrainSize, context.mThreadCount);
+}
+
+// The pipelined step running in the background while the instance writes,
+// standing in for the app's parallel recording, run on the calling thread and
+// the workers. Of the mThreadCount threads, stepThreads go to the step and the
+// rest to the writes, or all of them to both when stepThreads is 0. With wait
+// set the step is finished before the writes start. See StepOrder in the app.
+static void runStepOverlap(BenchContext &context, uint32_t stepThreads,
+                           bool wait) {
+  const SphereFrame &frame = context.mFrame;
+  context.mVisibleCount = countVisibleSpheres(
+      frame.pBlockLodCount, context.mCount, context.mLodVisibleCount,
+      context.mLodInstanceOffset, frame.pBlockLodOffset);
+
+  const uint32_t threads = context.mThreadCount;
+  uint32_t writeThreads = threads;
+  if (stepThreads == 0)
+    stepThreads = threads;
+  else
+    writeThreads = threads > stepThreads ? threads - stepThreads : 1;
+
+  // The step reads the state the writes read and writes the other one.
+  SphereStep &step = context.mStep;
+  step.mSrc = frame.mState;
+  step.mFrame = frame.mFrame;
+  beginParallelFor(&context.mStepJob, context.pThreads, stepSphereRange, &step,
+                   context.mCount, gBenchGrainSize, stepThreads);
+  if (wait)
+    waitParallelFor(&context.mStepJob);
+  parallelFor(context.pThreads, writeSphereFrameRange, &context.mFrame,
+              context.mCount, gBenchGrainSize, writeThreads);
+  waitParallelFor(&context.mStepJob);
+}
+
+static void benchOverlapShared(BenchContext &context) {
+  runStepOverlap(context, 0, false);
+}
+
+static void benchOverlapWait(BenchContext &context) {
+  runStepOverlap(context, 0, true);
+}
+
+static void benchOverlapSplit(BenchContext &context) {
+  const uint32_t stepThreads = context.mThreadCount / 2;
+  runStepOverlap(context, stepThreads > 0 ? stepThreads : 1, false);
+}
+
+// The build the app does for every pick.
+static void benchGridBuild(BenchContext &context) {
+  exitSphereGrid(context.mGrid);
+  initSphereGrid(context.mGrid, context.mGridState, context.mCount);
+}
+
+static void benchGridFrustum(BenchContext &context) {
+  context.mVisibleCount =
+      queryGridFrustum(context.mGrid, context.mGridState,
+                       context.mFrame.mFrustum, gSphereRadius,
+                       context.pGridVisible);
+}
+
+static void benchGridRay(BenchContext &context) {
+  for (const float3 &dir : context.mRayDirs) {
+    uint32_t sphere;
+    float t;
+    queryGridRay(context.mGrid, context.mGridState, float3(0.0f, 0.0f, 0.0f),
+                 dir, 2.0f * gSpawnDistance, gSphereRadius, &sphere, &t);
+  }
+}
+
+static void benchScanRay(BenchContext &context) {
+  for (const float3 &dir : context.mRayDirs) {
+    uint32_t sphere;
+    float t;
+    raycastSpheres(context.mGridState, context.mCount,
+                   float3(0.0f, 0.0f, 0.0f), dir, 2.0f * gSpawnDistance,
+                   gSphereRadius, &sphere, &t);
+  }
+}
+
+struct Benchmark {
+  const char *pName;
+  void (*pRun)(BenchContext &context);
+  // Nominal bytes read plus written per sphere, or per visible sphere when
+  // mPerVisible is set. Respawns are not counted.
+  uint32_t mBytesPerSphere;
+  bool mPerVisible;
+  bool mMultithreaded;
+};
+
+// The AoS update drags x, y and color through the cache along with z.
+const Benchmark gBenchmarks[] = {
+    {"update/soa_scalar", benchUpdateSoaScalar, 8, false, true},
+    {"update/soa_simd", benchUpdateSoaSimd, 8, false, true},
+    {"update/aos_scalar", benchUpdateAosScalar, 32, false, true},
+    {"step/soa_simd", benchStepSoaSimd, 32, false, true},
+    {"cull", benchCull, 17, false, true},
+    {"frame", benchFrame, 25, false, true},
+    {"write", benchWrite, 28, true, true},
+    // Key and index written, then read and written again by each of the two
+    // passes, the digit counting reading the keys once more.
+    {"sort", benchSort, 56, true, true},
+    {"write/sorted", benchWriteSorted, 32, true, true},
+    // Step and writes together, compared by time alone.
+    {"overlap/shared", benchOverlapShared, 0, false, true},
+    {"overlap/wait", benchOverlapWait, 0, false, true},
+    {"overlap/split", benchOverlapSplit, 0, false, true},
+    // Positions read, the cell of each sphere written and read back, and
+    // its index written to the cell's list.
+    {"grid/build", benchGridBuild, 20, false, false},
+    {"grid/frustum", benchGridFrustum, 16, true, false},
+    // gBenchRayCount rays per iteration. Compute bound, no bytes counted.
+    {"grid/ray", benchGridRay, 0, false, false},
+    {"scan/ray", benchScanRay, 0, false, false},
+};
+
+struct BenchResult {
+  double mNsPerSphere;
+  double mGBPerSecond;
+  uint32_t mIterations;
+};
+
+static BenchResult runBenchmark(const Benchmark &benchmark,
+                                BenchContext &context, double minTime) {
+  // One untimed run to fault in pages and warm the caches.
+  ++context.mFrame.mFrame;
+  benchmark.pRun(context);
+
+  uint32_t iterations = 0;
+  int64_t elapsed = 0;
+  const int64_t start = getUSec();
+  do {
+    ++context.mFrame.mFrame;
+    benchmark.pRun(context);
+    ++iterations;
+    elapsed = getUSec() - start;
+  } while ((double)elapsed < minTime * 1e6);
+
+  const double seconds = (double)elapsed * 1e-6;
+  const double spheres = (double)context.mCount * iterations;
+  const double bytes =
+      (double)benchmark.mBytesPerSphere * iterations *
+      (benchmark.mPerVisible ? context.mVisibleCount : context.mCount);
+
+  BenchResult result;
+  result.mNsPerSphere = seconds * 1e9 / spheres;
+  result.mGBPerSecond = bytes / seconds * 1e-9;
+  result.mIterations = iterations;
+  return result;
+}
+
+static void initBenchContext(BenchContext &context, uint32_t count) {
+  context.mCount = count;
+  SphereFrame &frame = context.mFrame;
+  frame.mState = allocSphereState(count);
+  frame.pSphereLod = (uint8_t *)tf_malloc(count);
+  frame.pBlockLodCount = (uint32_t *)tf_calloc(
+      sphereBlockCount(count) * gSphereLodCount, sizeof(uint32_t));
+  frame.pBlockLodOffset = (uint32_t *)tf_calloc(
+      sphereBlockCount(count) * gSphereLodCount, sizeof(uint32_t));
+  frame.pInstances =
+      (SphereInstance *)tf_malloc(count * sizeof(SphereInstance));
+  frame.pSortKeys = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  frame.pSortSpheres = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  context.pSphereDepth = (uint16_t *)tf_calloc(count, sizeof(uint16_t));
+  context.mSortScratch = allocRadixSortScratch(count);
+  frame.mDeltaZ = gBenchDeltaZ;
+  frame.mSeed = gBenchSeed;
+  frame.mFrame = 0;
+  frame.mSimd = true;
+  frame.mCull = true;
+  frame.mInstanceOrigin = float3(0.0f, 0.0f, 0.0f);
+
+  const mat4 projMat =
+      mat4::perspective(gBenchHorizontalFov,
+                        (float)gBenchHeight / (float)gBenchWidth, 1000.0f, 0.3f);
+  frame.mFrustum = extractFrustum(projMat);
+  frame.mLodSelection = makeLodSelection(
+      projMat, projMat.getCol(1).getY() * 0.5f * gBenchHeight);
+
+  context.mStep.mDst = allocSphereState(count);
+  context.mStep.mDeltaZ = gBenchDeltaZ;
+  context.mStep.mSeed = gBenchSeed;
+  context.mStep.mSimd = true;
+
+  context.pAos = (SphereAos *)tf_memalign(16, count * sizeof(SphereAos));
+  for (uint32_t i = 0; i < count; ++i) {
+    respawnSphereScalar(frame.mState, i, gBenchSeed, 0);
+    respawnSphereAos(context.pAos[i], i, gBenchSeed, 0);
+  }
+
+  context.mGridState = allocSphereState(count);
+  copySphereState(context.mGridState, frame.mState, count);
+  initSphereGrid(context.mGrid, context.mGridState, count);
+  context.pGridVisible = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  // Directions spread over the view, toward the spawn ball.
+  for (uint32_t r = 0; r < gBenchRayCount; ++r) {
+    const uint32_t key = sphereRandomKey(gBenchSeed, r, 0);
+    const float x = unitFloat(sphereRandom(key, 0)) - 0.5f;
+    const float y = unitFloat(sphereRandom(key, 1)) - 0.5f;
+    const float invLength = 1.0f / sqrtf(x * x + y * y + 1.0f);
+    context.mRayDirs[r] = float3(x * invLength, y * invLength, invLength);
+  }
+
+  // write and sort read what the last cull wrote.
+  context.mThreadCount = 1;
+  frame.pSphereDepth = context.pSphereDepth;
+  classifySpheres(frame, 0, count);
+  frame.pSphereDepth = nullptr;
+  benchWrite(context);
+  benchSort(context);
+}
+
+static void exitBenchContext(BenchContext &context) {
+  freeSphereState(context.mFrame.mState);
+  freeSphereState(context.mStep.mDst);
+  tf_free(context.mFrame.pSphereLod);
+  tf_free(context.mFrame.pBlockLodCount);
+  tf_free(context.mFrame.pBlockLodOffset);
+  tf_free(context.mFrame.pInstances);
+  tf_free(context.mFrame.pSortKeys);
+  tf_free(context.mFrame.pSortSpheres);
+  tf_free(context.pSphereDepth);
+  freeRadixSortScratch(context.mSortScratch);
+  tf_free(context.pAos);
+  freeSphereState(context.mGridState);
+  exitSphereGrid(context.mGrid);
+  tf_free(context.pGridVisible);
+}
+
+int main(int argc, char **argv) {
+  const char *pFilter = nullptr;
+  double minTime = 0.5;
+  const char *pCsvPath = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+      pFilter = argv[++i];
+    else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+      minTime = atof(argv[++i]);
+    else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc)
+      pCsvPath = argv[++i];
+  }
+
+  FILE *pCsv = nullptr;
+  if (pCsvPath) {
+    pCsv = fopen(pCsvPath, "w");
+    if (!pCsv) {
+      fprintf(stderr, "Could not open %s\n", pCsvPath);
+      return 1;
+    }
+    fprintf(pCsv, "benchmark,spheres,threads,iterations,ns_per_sphere,gb_s\n");
+  }
+
+  ThreadSystem *pThreadSystem = nullptr;
+  initThreadSystem(&pThreadSystem);
+  uint32_t maxThreads = getThreadSystemThreadCount(pThreadSystem) + 1;
+  if (maxThreads > gMaxParallelForThreads)
+    maxThreads = gMaxParallelForThreads;
+  // 1, 2, 4, ... threads, then every thread there is.
+  uint32_t threadCounts[gMaxParallelForThreads];
+  uint32_t threadCountCount = 0;
+  for (uint32_t threads = 1; threads < maxThreads; threads *= 2)
+    threadCounts[threadCountCount++] = threads;
+  threadCounts[threadCountCount++] = maxThreads;
+
+  printf("%-52s %12s %10s %12s\n", "Benchmark", "ns/sphere", "GB/s",
+         "Iterations");
+  for (uint32_t count : gBenchSphereCounts) {
+    BenchContext context = {};
+    context.pThreads = pThreadSystem;
+    initBenchContext(context, count);
+
+    for (const Benchmark &benchmark : gBenchmarks) {
+      if (pFilter && !strstr(benchmark.pName, pFilter))
+        continue;
+
+      const uint32_t sweepCount =
+          benchmark.mMultithreaded ? threadCountCount : 1;
+      for (uint32_t t = 0; t < sweepCount; ++t) {
+        const uint32_t threads = threadCounts[t];
+        context.mThreadCount = threads;
+        BenchResult result = runBenchmark(benchmark, context, minTime);
+
+        char name[128];
+        snprintf(name, sizeof(name), "%s/spheres:%u/threads:%u",
+                 benchmark.pName, count, threads);
+        printf("%-52s %12.3f %10.2f %12u\n", name, result.mNsPerSphere,
+               result.mGBPerSecond, result.mIterations);
+        if (pCsv) {
+          fprintf(pCsv, "%s,%u,%u,%u,%.4f,%.3f\n", benchmark.pName, count,
+                  threads, result.mIterations, result.mNsPerSphere,
+                  result.mGBPerSecond);
+        }
+      }
+    }
+
+    exitBenchContext(context);
+  }
+
+  shutdownThreadSystem(pThreadSystem);
+  if (pCsv)
+    fclose(pCsv);
+  return 0;
+}
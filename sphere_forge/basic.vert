@@ -26,15 +26,33 @@
 // for planets in Unit Test 12 - Transformations
 
 
-cbuffer uniformBlock : register(b0, UPDATE_FREQ_PER_FRAME)
+cbuffer frameBlock : register(b0, UPDATE_FREQ_PER_FRAME)
 {
 	float4x4 mvp;
-    float4x4 world;
-    float4 color;
 
     // Point Light Information
-    float3 lightPosition;
-    float3 lightColor;
+    float4 lightPosition;
+    float4 lightColor;
+
+    // World position the instance positions are relative to
+    float4 instanceOrigin;
+};
+
+// Matches SphereInstance in sphere_sim.h
+struct SphereInstance
+{
+    uint positionXY; // half x, half y
+    uint positionZ; // half z
+    uint color; // RGBA8
+};
+
+StructuredBuffer<SphereInstance> instanceBuffer : register(t0, UPDATE_FREQ_PER_FRAME);
+
+// First record of the draw. The per-draw path passes the sphere index here
+// and draws a single instance.
+cbuffer sphereRootConstant : register(b1, UPDATE_FREQ_PER_DRAW)
+{
+    uint instanceOffset;
 };
 
 struct VSInput
@@ -48,27 +66,39 @@ struct VSOutput {
     float4 Color : COLOR;
 };
 
-VSOutput main(VSInput input)
+float4 unpackColor(uint color)
+{
+    return float4(color & 0xff, (color >> 8) & 0xff, (color >> 16) & 0xff, color >> 24) / 255.0f;
+}
+
+float3 unpackPosition(SphereInstance instance)
+{
+    return instanceOrigin.xyz + f16tof32(uint3(instance.positionXY, instance.positionXY >> 16, instance.positionZ));
+}
+
+VSOutput main(VSInput input, uint InstanceID : SV_InstanceID)
 {
     VSOutput result;
-    float4x4 tempMat = mul(mvp, world);
-    result.Position = mul(tempMat, input.Position);
+    SphereInstance instance = instanceBuffer[instanceOffset + InstanceID];
+    float4 color = unpackColor(instance.color);
+
+    float4 pos = float4(input.Position.xyz + unpackPosition(instance), 1.0f);
+    result.Position = mul(mvp, pos);
 
-    float4 normal = normalize(mul(world, float4(input.Normal.xyz, 0.0f))); // Assume uniform scaling
-    float4 pos = mul(world, float4(input.Position.xyz, 1.0f));
+    float4 normal = normalize(float4(input.Normal.xyz, 0.0f)); // Translation only
 
     float lightIntensity = 1.0f;
     float quadraticCoeff = 1.2;
     float ambientCoeff = 0.4;
 
-    float3 lightDir = normalize(lightPosition - pos.xyz);
+    float3 lightDir = normalize(lightPosition.xyz - pos.xyz);
 
     float distance = length(lightDir);
     float attenuation = 1.0 / (quadraticCoeff * distance * distance);
     float intensity = lightIntensity * attenuation;
 
     float3 baseColor = color.xyz;
-    float3 blendedColor = mul(lightColor * baseColor, lightIntensity);
+    float3 blendedColor = mul(lightColor.xyz * baseColor, lightIntensity);
     float3 diffuse = mul(blendedColor, max(dot(normal.xyz, lightDir), 0.0));
     float3 ambient = mul(baseColor, ambientCoeff);
     result.Color = float4(diffuse + ambient, 1.0);
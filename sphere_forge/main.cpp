@@ -1,586 +1,2470 @@
-#include <functional>
-#include <random>
-
-#include <OS/Interfaces/IApp.h>
-#include <OS/Interfaces/ICameraController.h>
-#include <OS/Interfaces/IInput.h>
-#include <OS/Interfaces/IProfiler.h>
-#include <OS/Interfaces/IThread.h>
-
-#include <OS/Core/ThreadSystem.h>
-#include <OS/Math/MathTypes.h>
-
-#include <Renderer/IRenderer.h>
-#include <Renderer/IResourceLoader.h>
-
-#include <UI/AppUI.h>
-
-constexpr size_t sphereCount = 10240;
-constexpr float speed = 500.0f;
-
-struct UniformBlock {
-  mat4 mProjectView;
-  mat4 mWorld;
-  vec4 mColor;
-
-  // Point Light Information
-  vec3 mLightPosition;
-  vec3 mLightColor;
-};
-
-Renderer *pRenderer = nullptr;
-constexpr uint32_t gImageCount = 3;
-
-constexpr int gSphereResolution = 10;
-constexpr float gSphereDiameter = 1.0f;
-
-Queue *pGraphicsQueue = nullptr;
-CmdPool *pCmdPools[gImageCount] = {nullptr};
-Cmd *pCmds[gImageCount] = {nullptr};
-
-SwapChain *pSwapChain = nullptr;
-RenderTarget *pDepthBuffer = nullptr;
-Fence *pRenderCompleteFences[gImageCount] = {nullptr};
-Semaphore *pImageAcquiredSemaphore = nullptr;
-Semaphore *pRenderCompleteSemaphores[gImageCount] = {nullptr};
-
-Shader *pShader = nullptr;
-Buffer *pVertexBuffer = nullptr;
-Pipeline *pPipeline = nullptr;
-
-uint32_t gFrameIndex = 0;
-ProfileToken gGpuProfileToken = PROFILE_INVALID_TOKEN;
-
-GuiComponent *pGuiWindow;
-
-UIApp gAppUI;
-
-RootSignature *pRootSignature = nullptr;
-
-ThreadSystem *pThreadSystem{nullptr};
-
-DescriptorSet *pDescriptorSetUniforms[sphereCount] = {nullptr};
-vec4 spherePos[sphereCount];
-vec4 colors[sphereCount];
-UniformBlock gUniformData[sphereCount];
-Buffer *pProjViewUniformBuffer[gImageCount][sphereCount] = {nullptr};
-
-ICameraController *pCameraController = {};
-
-bool bToggleVSync = false;
-
-TextDrawDesc gFrameTimeDraw = TextDrawDesc(0, 0xff00ffff, 18);
-
-int gNumberOfSpherePoints;
-
-vec4 RandomInsideUnitSphere() {
-  static std::default_random_engine generator;
-  static std::uniform_real_distribution<float> distribution(0, 1);
-  static auto r = std::bind(distribution, generator);
-
-  float x, y, z, d;
-  do {
-    x = r() * 2.0f - 1.0f;
-    y = r() * 2.0f - 1.0f;
-    z = r() * 2.0f - 1.0f;
-
-    d = x * x + y * y + z * z;
-  } while (d > 1.0);
-
-  return {x, y, z, 1.0f};
-}
-
-vec4 RandomColor() {
-  static std::default_random_engine generator;
-  static std::uniform_real_distribution<float> distribution(0, 1);
-  static auto r = std::bind(distribution, generator);
-
-  return {r(), r(), r(), 1.0f};
-}
-
-struct updateSphereData {
-  float deltaTime;
-};
-
-void updateSphere(void *pData, uintptr_t i) {
-  auto pSphereData = static_cast<updateSphereData *>(pData);
-  float z = spherePos[i].getZ();
-  if (z < 0) {
-    spherePos[i] = RandomInsideUnitSphere() * 500;
-    z = spherePos[i].getZ() + 1000;
-    colors[i] = RandomColor();
-  } else {
-    z -= pSphereData->deltaTime * speed;
-  }
-  spherePos[i].setZ(z);
-
-  gUniformData[i].mWorld = mat4::translation(
-      {spherePos[i].getX(), spherePos[i].getY(), spherePos[i].getZ()});
-  gUniformData[i].mColor = colors[i];
-}
-
-class App : public IApp {
-  virtual bool Init() {
-    // FILE PATHS
-    fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_SHADER_SOURCES,
-                            "Shaders");
-    fsSetPathForResourceDir(pSystemFileIO, RM_DEBUG, RD_SHADER_BINARIES,
-                            "CompiledShaders");
-    fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_GPU_CONFIG, "GPUCfg");
-    fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_FONTS, "Fonts");
-
-    // window and renderer setup
-    RendererDesc settings = {0};
-    initRenderer(GetName(), &settings, &pRenderer);
-    // check for init success
-    if (!pRenderer)
-      return false;
-
-    QueueDesc queueDesc = {};
-    queueDesc.mType = QUEUE_TYPE_GRAPHICS;
-    queueDesc.mFlag = QUEUE_FLAG_INIT_MICROPROFILE;
-    addQueue(pRenderer, &queueDesc, &pGraphicsQueue);
-
-    for (uint32_t i = 0; i < gImageCount; ++i) {
-      CmdPoolDesc cmdPoolDesc = {};
-      cmdPoolDesc.pQueue = pGraphicsQueue;
-      addCmdPool(pRenderer, &cmdPoolDesc, &pCmdPools[i]);
-      CmdDesc cmdDesc = {};
-      cmdDesc.pPool = pCmdPools[i];
-      addCmd(pRenderer, &cmdDesc, &pCmds[i]);
-
-      addFence(pRenderer, &pRenderCompleteFences[i]);
-      addSemaphore(pRenderer, &pRenderCompleteSemaphores[i]);
-    }
-    addSemaphore(pRenderer, &pImageAcquiredSemaphore);
-
-    initResourceLoaderInterface(pRenderer);
-
-    float *pSpherePoints;
-    generateSpherePoints(&pSpherePoints, &gNumberOfSpherePoints,
-                         gSphereResolution, gSphereDiameter);
-
-    uint64_t sphereDataSize = gNumberOfSpherePoints * sizeof(float);
-    BufferLoadDesc sphereVbDesc = {};
-    sphereVbDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_VERTEX_BUFFER;
-    sphereVbDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
-    sphereVbDesc.mDesc.mSize = sphereDataSize;
-    sphereVbDesc.pData = pSpherePoints;
-    sphereVbDesc.ppBuffer = &pVertexBuffer;
-    addResource(&sphereVbDesc, nullptr);
-
-    ShaderLoadDesc shaderDesc = {};
-    shaderDesc.mStages[0] = {"basic.vert", nullptr, 0};
-    shaderDesc.mStages[1] = {"basic.frag", nullptr, 0};
-    addShader(pRenderer, &shaderDesc, &pShader);
-
-    Shader *shaders[] = {pShader};
-    RootSignatureDesc rootDesc = {};
-    rootDesc.mStaticSamplerCount = 0;
-    rootDesc.mShaderCount = 1;
-    rootDesc.ppShaders = shaders;
-    addRootSignature(pRenderer, &rootDesc, &pRootSignature);
-
-    DescriptorSetDesc desc = {pRootSignature, DESCRIPTOR_UPDATE_FREQ_PER_FRAME,
-                              gImageCount};
-    for (auto i = 0; i < sphereCount; i++) {
-      addDescriptorSet(pRenderer, &desc, &pDescriptorSetUniforms[i]);
-    }
-
-    BufferLoadDesc ubDesc = {};
-    ubDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    ubDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
-    ubDesc.mDesc.mSize = sizeof(UniformBlock);
-    ubDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
-    ubDesc.pData = nullptr;
-    for (uint32_t i = 0; i < gImageCount; ++i) {
-      for (auto j = 0; j < sphereCount; j++) {
-        ubDesc.ppBuffer = &pProjViewUniformBuffer[i][j];
-        addResource(&ubDesc, nullptr);
-      }
-    }
-
-    if (!gAppUI.Init(pRenderer))
-      return false;
-
-    gAppUI.LoadFont("TitilliumText/TitilliumText-Bold.otf");
-
-    CameraMotionParameters cmp{160.0f, 600.0f, 200.0f};
-    vec3 lookAt{0, 0, 500};
-    vec3 camPos{0.0f, 0.0f, 0.0f};
-
-    pCameraController = createFpsCameraController(camPos, lookAt);
-
-    pCameraController->setMotionParameters(cmp);
-
-    if (!initInputSystem(pWindow))
-      return false;
-
-    // Initialize microprofiler and it's UI.
-    initProfiler();
-
-    // Gpu profiler can only be added after initProfile.
-    gGpuProfileToken = addGpuProfiler(pRenderer, pGraphicsQueue, "Graphics");
-
-    GuiDesc guiDesc = {};
-    guiDesc.mStartPosition =
-        vec2(mSettings.mWidth * 0.01f, mSettings.mHeight * 0.2f);
-    pGuiWindow = gAppUI.AddGuiComponent(GetName(), &guiDesc);
-
-    pGuiWindow->AddWidget(
-        CheckboxWidget("Toggle VSync\t\t\t\t\t", &bToggleVSync));
-
-    // App Actions
-    InputActionDesc actionDesc = {InputBindings::BUTTON_DUMP,
-                                  [](InputActionContext *ctx) {
-                                    dumpProfileData(
-                                        ((Renderer *)ctx->pUserData),
-                                        ((Renderer *)ctx->pUserData)->pName);
-                                    return true;
-                                  },
-                                  pRenderer};
-    addInputAction(&actionDesc);
-    actionDesc = {InputBindings::BUTTON_FULLSCREEN,
-                  [](InputActionContext *ctx) {
-                    toggleFullscreen(((IApp *)ctx->pUserData)->pWindow);
-                    return true;
-                  },
-                  this};
-    addInputAction(&actionDesc);
-    actionDesc = {InputBindings::BUTTON_EXIT, [](InputActionContext *ctx) {
-                    requestShutdown();
-                    return true;
-                  }};
-    addInputAction(&actionDesc);
-    actionDesc = {InputBindings::BUTTON_ANY,
-                  [](InputActionContext *ctx) {
-                    bool capture = gAppUI.OnButton(ctx->mBinding, ctx->mBool,
-                                                   ctx->pPosition);
-                    setEnableCaptureInput(
-                        capture && INPUT_ACTION_PHASE_CANCELED != ctx->mPhase);
-                    return true;
-                  },
-                  this};
-    addInputAction(&actionDesc);
-
-    waitForAllResourceLoads();
-
-    // Need to free memory;
-    tf_free(pSpherePoints);
-    size_t size = sizeof(UniformBlock);
-    for (auto i = 0; i < sphereCount; i++) {
-      for (uint32_t j = 0; j < gImageCount; ++j) {
-        DescriptorData params[1] = {};
-        params[0].pName = "uniformBlock";
-        params[0].ppBuffers = &pProjViewUniformBuffer[j][i];
-        updateDescriptorSet(pRenderer, j, pDescriptorSetUniforms[i], 1, params);
-      }
-    }
-
-    mat4 viewMat = pCameraController->getViewMatrix();
-    const float aspectInverse =
-        (float)mSettings.mHeight / (float)mSettings.mWidth;
-    const float horizontal_fov = 120.0f * PI / 180.0f;
-    mat4 projMat =
-        mat4::perspective(horizontal_fov, aspectInverse, 1000.0f, 0.3f);
-    auto projView = projMat * viewMat;
-
-    for (int i = 0; i < sphereCount; i++) {
-      gUniformData[i].mProjectView = projView;
-      gUniformData[i].mWorld = mat4::translation(
-          {spherePos[i].getX(), spherePos[i].getY(), spherePos[i].getZ()});
-      gUniformData[i].mColor = colors[i];
-      // point light parameters
-      gUniformData[i].mLightPosition = vec3(0, 0, 0);
-      gUniformData[i].mLightColor = vec3(0.9f, 0.9f, 0.7f); // Pale Yellow
-    }
-
-    initThreadSystem(&pThreadSystem);
-
-    return true;
-  }
-
-  virtual void Exit() {
-    waitQueueIdle(pGraphicsQueue);
-
-    exitInputSystem();
-
-    destroyCameraController(pCameraController);
-
-    gAppUI.Exit();
-
-    // Exit profile
-    exitProfiler();
-
-    for (uint32_t i = 0; i < gImageCount; ++i) {
-      for (auto j = 0; j < sphereCount; j++) {
-        removeResource(pProjViewUniformBuffer[i][j]);
-      }
-    }
-    for (auto i = 0; i < sphereCount; i++) {
-      removeDescriptorSet(pRenderer, pDescriptorSetUniforms[i]);
-    }
-
-    removeResource(pVertexBuffer);
-
-    removeShader(pRenderer, pShader);
-
-    removeRootSignature(pRenderer, pRootSignature);
-
-    for (uint32_t i = 0; i < gImageCount; ++i) {
-      removeFence(pRenderer, pRenderCompleteFences[i]);
-      removeSemaphore(pRenderer, pRenderCompleteSemaphores[i]);
-
-      removeCmd(pRenderer, pCmds[i]);
-      removeCmdPool(pRenderer, pCmdPools[i]);
-    }
-    removeSemaphore(pRenderer, pImageAcquiredSemaphore);
-
-    exitResourceLoaderInterface(pRenderer);
-    removeQueue(pRenderer, pGraphicsQueue);
-    removeRenderer(pRenderer);
-
-    shutdownThreadSystem(pThreadSystem);
-  }
-
-  bool addSwapChain() {
-    SwapChainDesc swapChainDesc = {};
-    swapChainDesc.mWindowHandle = pWindow->handle;
-    swapChainDesc.mPresentQueueCount = 1;
-    swapChainDesc.ppPresentQueues = &pGraphicsQueue;
-    swapChainDesc.mWidth = mSettings.mWidth;
-    swapChainDesc.mHeight = mSettings.mHeight;
-    swapChainDesc.mImageCount = gImageCount;
-    swapChainDesc.mColorFormat = getRecommendedSwapchainFormat(true);
-    swapChainDesc.mEnableVsync = mSettings.mDefaultVSyncEnabled;
-    ::addSwapChain(pRenderer, &swapChainDesc, &pSwapChain);
-
-    return pSwapChain != nullptr;
-  }
-
-  bool addDepthBuffer() {
-    // Add depth buffer
-    RenderTargetDesc depthRT = {};
-    depthRT.mArraySize = 1;
-    depthRT.mClearValue.depth = 0.0f;
-    depthRT.mClearValue.stencil = 0;
-    depthRT.mDepth = 1;
-    depthRT.mFormat = TinyImageFormat_D32_SFLOAT;
-    depthRT.mHeight = mSettings.mHeight;
-    depthRT.mSampleCount = SAMPLE_COUNT_1;
-    depthRT.mSampleQuality = 0;
-    depthRT.mWidth = mSettings.mWidth;
-    depthRT.mFlags = TEXTURE_CREATION_FLAG_ON_TILE;
-    addRenderTarget(pRenderer, &depthRT, &pDepthBuffer);
-
-    return pDepthBuffer != nullptr;
-  }
-
-  virtual bool Load() override {
-    if (!addSwapChain())
-      return false;
-
-    if (!addDepthBuffer())
-      return false;
-
-    if (!gAppUI.Load(pSwapChain->ppRenderTargets, 1))
-      return false;
-
-    loadProfilerUI(&gAppUI, mSettings.mWidth, mSettings.mHeight);
-
-    // layout and pipeline for sphere draw
-    VertexLayout vertexLayout = {};
-    vertexLayout.mAttribCount = 2;
-    vertexLayout.mAttribs[0].mSemantic = SEMANTIC_POSITION;
-    vertexLayout.mAttribs[0].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
-    vertexLayout.mAttribs[0].mBinding = 0;
-    vertexLayout.mAttribs[0].mLocation = 0;
-    vertexLayout.mAttribs[0].mOffset = 0;
-    vertexLayout.mAttribs[1].mSemantic = SEMANTIC_NORMAL;
-    vertexLayout.mAttribs[1].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
-    vertexLayout.mAttribs[1].mBinding = 0;
-    vertexLayout.mAttribs[1].mLocation = 1;
-    vertexLayout.mAttribs[1].mOffset = 3 * sizeof(float);
-
-    RasterizerStateDesc rasterizerStateDesc = {};
-    rasterizerStateDesc.mCullMode = CULL_MODE_FRONT;
-
-    DepthStateDesc depthStateDesc = {};
-    depthStateDesc.mDepthTest = true;
-    depthStateDesc.mDepthWrite = true;
-    depthStateDesc.mDepthFunc = CMP_GEQUAL;
-
-    PipelineDesc desc = {};
-    desc.mType = PIPELINE_TYPE_GRAPHICS;
-    GraphicsPipelineDesc &pipelineSettings = desc.mGraphicsDesc;
-    pipelineSettings.mPrimitiveTopo = PRIMITIVE_TOPO_TRI_LIST;
-    pipelineSettings.mRenderTargetCount = 1;
-    pipelineSettings.pDepthState = &depthStateDesc;
-    pipelineSettings.pColorFormats = &pSwapChain->ppRenderTargets[0]->mFormat;
-    pipelineSettings.mSampleCount =
-        pSwapChain->ppRenderTargets[0]->mSampleCount;
-    pipelineSettings.mSampleQuality =
-        pSwapChain->ppRenderTargets[0]->mSampleQuality;
-    pipelineSettings.mDepthStencilFormat = pDepthBuffer->mFormat;
-    pipelineSettings.pRootSignature = pRootSignature;
-    pipelineSettings.pShaderProgram = pShader;
-    pipelineSettings.pVertexLayout = &vertexLayout;
-    pipelineSettings.pRasterizerState = &rasterizerStateDesc;
-    addPipeline(pRenderer, &desc, &pPipeline);
-
-    return true;
-  }
-  virtual void Unload() override {
-    waitQueueIdle(pGraphicsQueue);
-
-    unloadProfilerUI();
-    gAppUI.Unload();
-
-    removePipeline(pRenderer, pPipeline);
-    removeSwapChain(pRenderer, pSwapChain);
-    removeRenderTarget(pRenderer, pDepthBuffer);
-  }
-
-  virtual void Update(float deltaTime) override {
-    if (pSwapChain->mEnableVsync != bToggleVSync) {
-      waitQueueIdle(pGraphicsQueue);
-      gFrameIndex = 0;
-      ::toggleVSync(pRenderer, &pSwapChain);
-    }
-
-    updateInputSystem(mSettings.mWidth, mSettings.mHeight);
-
-    pCameraController->update(deltaTime);
-
-    /************************************************************************/
-    // Scene Update
-    /************************************************************************/
-    // update camera with time
-
-    PROFILER_SET_CPU_SCOPE("Spheres", "Update position", 0xFFE8E8);
-    {
-      updateSphereData data{deltaTime};
-
-      addThreadSystemRangeTask(pThreadSystem, updateSphere, &data, sphereCount);
-      waitThreadSystemIdle(pThreadSystem);
-    }
-    gAppUI.Update(deltaTime);
-  }
-
-  virtual void Draw() override {
-    uint32_t swapchainImageIndex;
-    acquireNextImage(pRenderer, pSwapChain, pImageAcquiredSemaphore, nullptr,
-                     &swapchainImageIndex);
-
-    RenderTarget *pRenderTarget =
-        pSwapChain->ppRenderTargets[swapchainImageIndex];
-    Semaphore *pRenderCompleteSemaphore =
-        pRenderCompleteSemaphores[gFrameIndex];
-    Fence *pRenderCompleteFence = pRenderCompleteFences[gFrameIndex];
-
-    // Stall if CPU is running "Swap Chain Buffer Count" frames ahead of GPU
-    FenceStatus fenceStatus;
-    getFenceStatus(pRenderer, pRenderCompleteFence, &fenceStatus);
-    if (fenceStatus == FENCE_STATUS_INCOMPLETE)
-      waitForFences(pRenderer, 1, &pRenderCompleteFence);
-
-    // Update uniform buffers
-    for (auto i = 0; i < sphereCount; i++) {
-      BufferUpdateDesc viewProjCbv = {pProjViewUniformBuffer[gFrameIndex][i]};
-      beginUpdateResource(&viewProjCbv);
-      viewProjCbv.mSize = sizeof(UniformBlock) * sphereCount;
-      *(UniformBlock *)viewProjCbv.pMappedData = gUniformData[i];
-      endUpdateResource(&viewProjCbv, nullptr);
-    }
-    // Reset cmd pool for this frame
-    resetCmdPool(pRenderer, pCmdPools[gFrameIndex]);
-
-    Cmd *cmd = pCmds[gFrameIndex];
-    beginCmd(cmd);
-
-    cmdBeginGpuFrameProfile(cmd, gGpuProfileToken);
-
-    RenderTargetBarrier barriers[] = {
-        {pRenderTarget, RESOURCE_STATE_PRESENT, RESOURCE_STATE_RENDER_TARGET},
-    };
-    cmdResourceBarrier(cmd, 0, nullptr, 0, nullptr, 1, barriers);
-
-    // simply record the screen cleaning command
-    LoadActionsDesc loadActions = {};
-    loadActions.mLoadActionsColor[0] = LOAD_ACTION_CLEAR;
-    loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
-    loadActions.mClearDepth.depth = 0.0f;
-    loadActions.mClearDepth.stencil = 0;
-    cmdBindRenderTargets(cmd, 1, &pRenderTarget, pDepthBuffer, &loadActions,
-                         nullptr, nullptr, -1, -1);
-
-    cmdSetViewport(cmd, 0.0f, 0.0f, (float)pRenderTarget->mWidth,
-                   (float)pRenderTarget->mHeight, 0.0f, 1.0f);
-    cmdSetScissor(cmd, 0, 0, pRenderTarget->mWidth, pRenderTarget->mHeight);
-
-    const uint32_t sphereVbStride = sizeof(float) * 6;
-
-    ////// draw planets
-    cmdBeginGpuTimestampQuery(cmd, gGpuProfileToken, "Draw Spheres");
-    {
-      for (auto i = 0; i < sphereCount; i++) {
-        cmdBindPipeline(cmd, pPipeline);
-        cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetUniforms[i]);
-        cmdBindVertexBuffer(cmd, 1, &pVertexBuffer, &sphereVbStride, nullptr);
-        cmdDraw(cmd, gNumberOfSpherePoints / 6, 0);
-      }
-    }
-    cmdEndGpuTimestampQuery(cmd, gGpuProfileToken);
-
-    loadActions = {};
-    loadActions.mLoadActionsColor[0] = LOAD_ACTION_LOAD;
-    cmdBindRenderTargets(cmd, 1, &pRenderTarget, nullptr, &loadActions, nullptr,
-                         nullptr, -1, -1);
-    cmdBeginGpuTimestampQuery(cmd, gGpuProfileToken, "Draw UI");
-    {
-      const float txtIndent = 8.f;
-      float2 txtSizePx =
-          cmdDrawCpuProfile(cmd, float2(txtIndent, 15.f), &gFrameTimeDraw);
-      cmdDrawGpuProfile(cmd, float2(txtIndent, txtSizePx.y + 30.f),
-                        gGpuProfileToken, &gFrameTimeDraw);
-
-      cmdDrawProfilerUI();
-
-      gAppUI.Gui(pGuiWindow);
-      gAppUI.Draw(cmd);
-      cmdBindRenderTargets(cmd, 0, nullptr, nullptr, nullptr, nullptr, nullptr,
-                           -1, -1);
-      cmdEndGpuTimestampQuery(cmd, gGpuProfileToken);
-
-      barriers[0] = {pRenderTarget, RESOURCE_STATE_RENDER_TARGET,
-                     RESOURCE_STATE_PRESENT};
-      cmdResourceBarrier(cmd, 0, nullptr, 0, nullptr, 1, barriers);
-    }
-    cmdEndGpuFrameProfile(cmd, gGpuProfileToken);
-    endCmd(cmd);
-
-    QueueSubmitDesc submitDesc = {};
-    submitDesc.mCmdCount = 1;
-    submitDesc.mSignalSemaphoreCount = 1;
-    submitDesc.mWaitSemaphoreCount = 1;
-    submitDesc.ppCmds = &cmd;
-    submitDesc.ppSignalSemaphores = &pRenderCompleteSemaphore;
-    submitDesc.ppWaitSemaphores = &pImageAcquiredSemaphore;
-    submitDesc.pSignalFence = pRenderCompleteFence;
-    queueSubmit(pGraphicsQueue, &submitDesc);
-    QueuePresentDesc presentDesc = {};
-    presentDesc.mIndex = swapchainImageIndex;
-    presentDesc.mWaitSemaphoreCount = 1;
-    presentDesc.pSwapChain = pSwapChain;
-    presentDesc.ppWaitSemaphores = &pRenderCompleteSemaphore;
-    presentDesc.mSubmitDone = true;
-    queuePresent(pGraphicsQueue, &presentDesc);
-    flipProfiler();
-
-    gFrameIndex = (gFrameIndex + 1) % gImageCount;
-  }
-
-  virtual const char *GetName() override { return "Sphere Test"; }
-};
-
-DEFINE_APPLICATION_MAIN(App)
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <OS/Interfaces/IApp.h>
+#include <OS/Interfaces/ICameraController.h>
+#include <OS/Interfaces/IInput.h>
+#include <OS/Interfaces/ILog.h>
+#include <OS/Interfaces/IMemory.h>
+#include <OS/Interfaces/IProfiler.h>
+#include <OS/Interfaces/IThread.h>
+#include <OS/Interfaces/ITime.h>
+
+#include <OS/Core/ThreadSystem.h>
+#include <OS/Math/MathTypes.h>
+
+#include <Renderer/IRenderer.h>
+#include <Renderer/IResourceLoader.h>
+
+#include <UI/AppUI.h>
+
+#include "sphere_grid.h"
+#include "sphere_sim.h"
+#include "sphere_sort.h"
+
+// Sphere count bounds for --spheres and the UI slider.
+constexpr uint32_t gMinSphereCount = 1024;
+constexpr uint32_t gMaxSphereCount = 1024 * 1024;
+constexpr float speed = 500.0f;
+
+// Camera and light data shared by every sphere, uploaded once per frame.
+struct FrameUniformBlock {
+  mat4 mProjectView;
+
+  // Point Light Information
+  vec4 mLightPosition;
+  vec4 mLightColor;
+
+  // World position the instance positions are relative to, the camera.
+  vec4 mInstanceOrigin;
+};
+
+// Thread group size of sphere_update.comp.
+constexpr uint32_t gUpdateThreadCount = 64;
+
+// One level of detail of the sphere mesh. All levels share one vertex and one
+// index buffer.
+struct SphereLod {
+  uint32_t mSlices;
+  uint32_t mStacks;
+  uint32_t mIndexCount;
+  uint32_t mFirstIndex;
+  uint32_t mVertexOffset;
+};
+
+// gSphereLodCount levels, finest first. The impostor level is a single quad
+// and has no slices or stacks.
+SphereLod gSphereLods[gSphereLodCount] = {{16, 10}, {10, 6}, {6, 4}, {}};
+
+enum RenderMode : uint32_t {
+  RENDER_MODE_PER_DRAW = 0,
+  RENDER_MODE_INSTANCED,
+  RENDER_MODE_COUNT
+};
+
+const char *gRenderModeNames[RENDER_MODE_COUNT] = {"Per-Draw", "Instanced"};
+const uint32_t gRenderModeValues[RENDER_MODE_COUNT] = {RENDER_MODE_PER_DRAW,
+                                                       RENDER_MODE_INSTANCED};
+uint32_t gRenderMode = RENDER_MODE_INSTANCED;
+
+Renderer *pRenderer = nullptr;
+constexpr uint32_t gImageCount = 3;
+
+constexpr float gHorizontalFov = 120.0f * PI / 180.0f;
+
+Queue *pGraphicsQueue = nullptr;
+CmdPool *pCmdPools[gImageCount] = {nullptr};
+Cmd *pCmds[gImageCount] = {nullptr};
+// Records everything after the sphere draws when those are recorded in
+// parallel. Allocated from pCmdPools.
+Cmd *pUiCmds[gImageCount] = {nullptr};
+
+// Per-draw sphere draws are split across at most this many cmds, each with its
+// own pool so they can be recorded on different threads.
+constexpr uint32_t gMaxDrawCmdCount = 8;
+// Fewer draws than this per cmd are not worth another cmd.
+constexpr uint32_t gMinDrawsPerCmd = 256;
+CmdPool *pDrawCmdPools[gImageCount][gMaxDrawCmdCount] = {};
+Cmd *pDrawCmds[gImageCount][gMaxDrawCmdCount] = {};
+bool gParallelRecording = true;
+
+// Benchmark only: a pipeline statistics query around the sphere draws of each
+// cmd that has them, resolved from query 0 into the frame's readback buffer.
+QueryPool *pDrawStatsPools[gImageCount] = {};
+Buffer *pDrawStatsReadbackBuffers[gImageCount] = {};
+// Queries written by the frame that last used each frame index.
+uint32_t gDrawStatsCount[gImageCount] = {};
+// D3D12_QUERY_DATA_PIPELINE_STATISTICS, the layout of one resolved query.
+constexpr uint32_t gPipelineStatsCount = 11;
+constexpr uint32_t gPipelineStatsPsInvocations = 7;
+
+// How parallel recording shares the workers with a pipelined step that is
+// still running when Draw starts recording.
+enum StepOrder : uint32_t {
+  // Both are spread over every thread and compete for them.
+  STEP_ORDER_SHARED = 0,
+  // Recording waits for the step and then has every thread.
+  STEP_ORDER_WAIT,
+  // The step runs on half the threads and recording on the other half.
+  STEP_ORDER_SPLIT,
+  STEP_ORDER_COUNT
+};
+
+const char *gStepOrderNames[STEP_ORDER_COUNT] = {"shared", "wait", "split"};
+const uint32_t gStepOrderValues[STEP_ORDER_COUNT] = {
+    STEP_ORDER_SHARED, STEP_ORDER_WAIT, STEP_ORDER_SPLIT};
+uint32_t gStepOrder = STEP_ORDER_SPLIT;
+
+SwapChain *pSwapChain = nullptr;
+RenderTarget *pDepthBuffer = nullptr;
+Fence *pRenderCompleteFences[gImageCount] = {nullptr};
+Semaphore *pImageAcquiredSemaphore = nullptr;
+Semaphore *pRenderCompleteSemaphores[gImageCount] = {nullptr};
+
+Shader *pShader = nullptr;
+Buffer *pVertexBuffer = nullptr;
+Buffer *pIndexBuffer = nullptr;
+Pipeline *pPipeline = nullptr;
+// Draws gSphereImpostorLod. Shares pRootSignature, the vertex layout and the
+// descriptor sets with pPipeline.
+Shader *pImpostorShader = nullptr;
+Pipeline *pImpostorPipeline = nullptr;
+
+uint32_t gFrameIndex = 0;
+ProfileToken gGpuProfileToken = PROFILE_INVALID_TOKEN;
+
+GuiComponent *pGuiWindow;
+
+UIApp gAppUI;
+
+RootSignature *pRootSignature = nullptr;
+
+ThreadSystem *pThreadSystem{nullptr};
+
+DescriptorSet *pDescriptorSetUniforms = nullptr;
+uint32_t gSphereCount = 0;
+uint32_t gRequestedSphereCount = 10240;
+bool gSphereCountChanged = false;
+bool gSimdUpdate = true;
+uint32_t gRandomSeed = 0x5eed;
+uint32_t gSimFrame = 0;
+uint32_t gUpdateGrainSize = 1024;
+constexpr uint32_t gSphereSpawnGrainSize = 4096;
+bool gFrustumCulling = true;
+uint32_t gVisibleSphereCount = 0;
+uint32_t gLodVisibleCount[gSphereLodCount] = {};
+uint32_t gLodInstanceOffset[gSphereLodCount] = {};
+// Per sphere LOD and per block counts and offsets, see SphereFrame.
+uint8_t *gSphereLod = nullptr;
+uint32_t *gBlockLodCount = nullptr;
+uint32_t *gBlockLodOffset = nullptr;
+// Front-to-back order: the visible spheres of each LOD are radix sorted on
+// view depth before they are written to the instance buffer, so early depth
+// testing rejects most of the hidden fragments. CPU path only.
+bool gFrontToBack = false;
+// Spheres beyond gImpostorDistance, in view depth, are drawn as impostors
+// when enabled.
+bool gImpostors = false;
+float gImpostorDistance = 100.0f;
+uint16_t *gSphereDepth = nullptr;
+uint32_t *gSortKeys = nullptr;
+uint32_t *gSortSpheres = nullptr;
+RadixSortScratch gSortScratch = {};
+
+SphereState gSpheres = {};
+// Pipelined update: while a frame is drawn, the next frame's simulation step
+// runs on the workers, reading gSpheres and writing gNextSpheres.
+bool gPipelinedUpdate = true;
+SphereState gNextSpheres = {};
+SphereStep gSphereStep;
+BackgroundParallelFor gSphereStepJob;
+bool gSphereStepPending = false;
+// Threads the pending step was started on, see StepOrder.
+uint32_t gSphereStepThreads = gMaxParallelForThreads;
+SphereRespawnLog gRespawnLog = {};
+FrameUniformBlock gFrameUniformData;
+Buffer *pFrameUniformBuffer[gImageCount] = {nullptr};
+Buffer *pInstanceBuffer[gImageCount] = {nullptr};
+
+// GPU-driven path: sphere state lives on the GPU, a compute pass updates and
+// culls it and appends the visible spheres for an indirect draw. Its shaders
+// are HLSL and it has only been run on the DX12 backend, the only one this
+// solution builds, so other backends keep the CPU path until it is ported and
+// validated there.
+#if defined(DIRECT3D12)
+constexpr bool gGpuDrivenSupported = true;
+#else
+constexpr bool gGpuDrivenSupported = false;
+#endif
+bool gGpuDriven = false;
+bool gGpuDrivenActive = false;
+Shader *pUpdateShader = nullptr;
+RootSignature *pUpdateRootSignature = nullptr;
+Pipeline *pUpdatePipeline = nullptr;
+DescriptorSet *pDescriptorSetUpdate = nullptr;
+DescriptorSet *pDescriptorSetGpuDriven = nullptr;
+CommandSignature *pDrawCommandSignature = nullptr;
+Buffer *pGpuSphereBuffer = nullptr;
+Buffer *pDrawArgsResetBuffer = nullptr;
+Buffer *pUpdateUniformBuffer[gImageCount] = {nullptr};
+Buffer *pVisibleInstanceBuffer[gImageCount] = {nullptr};
+Buffer *pDrawArgsBuffer[gImageCount] = {nullptr};
+
+ICameraController *pCameraController = {};
+
+bool bToggleVSync = false;
+
+TextDrawDesc gFrameTimeDraw = TextDrawDesc(0, 0xff00ffff, 18);
+
+// Tooltip of the widget under the mouse, set by its pOnHover and drawn with
+// the frame stats for one frame.
+const char *pWidgetTooltip = nullptr;
+
+void showPipelinedUpdateTooltip() {
+  pWidgetTooltip = "Pipelined Update: each frame is stepped on the workers "
+                   "while the previous one is drawn, using the previous "
+                   "frame's time step";
+}
+
+// Matches updateBlock in sphere_update.comp.
+struct UpdateUniformBlock {
+  Frustum mFrustum;
+  LodSelection mLodSelection;
+  float mDeltaZ;
+  float mRadius;
+  float mSpawnRadius;
+  float mSpawnDistance;
+  uint32_t mSeed;
+  uint32_t mFrame;
+  uint32_t mSphereCount;
+  uint32_t mCullEnabled;
+  vec4 mInstanceOrigin;
+};
+
+// Simulation state of one sphere in the GPU-driven path. Matches Sphere in
+// sphere_update.comp.
+struct GpuSphere {
+  float3 mPosition;
+  uint32_t mColor;
+};
+
+UpdateUniformBlock gUpdateUniformData;
+
+// Runs a few frames of the scalar and SIMD update on copies of the current
+// state and reports whether they agree bit for bit.
+void verifySphereKernels() {
+  if (sphereKernelsMatch(gSpheres, gSphereCount, speed / 60.0f, gRandomSeed,
+                         180))
+    LOGF(LogLevel::eINFO, "SIMD sphere update matches scalar");
+  else
+    LOGF(LogLevel::eERROR, "SIMD sphere update differs from scalar");
+}
+
+inline uint32_t sphereVertexCount(uint32_t slices, uint32_t stacks) {
+  return 2 + (stacks - 1) * slices;
+}
+
+inline uint32_t sphereIndexCount(uint32_t slices, uint32_t stacks) {
+  return 6 * slices * (stacks - 1);
+}
+
+// UV sphere with one vertex per pole and shared vertices elsewhere, as
+// interleaved position/normal floats. Triangles are wound the same way as
+// generateSpherePoints, so the pipeline state is unchanged.
+void generateSphereMesh(uint32_t slices, uint32_t stacks, float radius,
+                        float *pVertices, uint16_t *pIndices) {
+  auto writeVertex = [&pVertices, radius](float x, float y, float z) {
+    *pVertices++ = x * radius;
+    *pVertices++ = y * radius;
+    *pVertices++ = z * radius;
+    *pVertices++ = x;
+    *pVertices++ = y;
+    *pVertices++ = z;
+  };
+
+  writeVertex(0.0f, 1.0f, 0.0f);
+  for (uint32_t stack = 1; stack < stacks; ++stack) {
+    const float theta = PI * stack / stacks;
+    for (uint32_t slice = 0; slice < slices; ++slice) {
+      const float phi = 2.0f * PI * slice / slices;
+      writeVertex(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+    }
+  }
+  writeVertex(0.0f, -1.0f, 0.0f);
+
+  const uint16_t bottom = (uint16_t)sphereVertexCount(slices, stacks) - 1;
+  auto ring = [slices](uint32_t stack, uint32_t slice) {
+    return (uint16_t)(1 + (stack - 1) * slices + slice % slices);
+  };
+  for (uint32_t slice = 0; slice < slices; ++slice) {
+    *pIndices++ = 0;
+    *pIndices++ = ring(1, slice);
+    *pIndices++ = ring(1, slice + 1);
+  }
+  for (uint32_t stack = 1; stack + 1 < stacks; ++stack) {
+    for (uint32_t slice = 0; slice < slices; ++slice) {
+      *pIndices++ = ring(stack, slice);
+      *pIndices++ = ring(stack + 1, slice);
+      *pIndices++ = ring(stack, slice + 1);
+      *pIndices++ = ring(stack, slice + 1);
+      *pIndices++ = ring(stack + 1, slice);
+      *pIndices++ = ring(stack + 1, slice + 1);
+    }
+  }
+  for (uint32_t slice = 0; slice < slices; ++slice) {
+    *pIndices++ = ring(stacks - 1, slice);
+    *pIndices++ = bottom;
+    *pIndices++ = ring(stacks - 1, slice + 1);
+  }
+}
+
+constexpr uint32_t gImpostorVertexCount = 4;
+constexpr uint32_t gImpostorIndexCount = 6;
+
+// Quad with corners at -1 and 1 in x and y, in the sphere mesh vertex format.
+// sphere_impostor.vert sizes it and turns it to the camera.
+void generateImpostorQuad(float *pVertices, uint16_t *pIndices) {
+  const float corners[gImpostorVertexCount][2] = {
+      {-1.0f, -1.0f}, {1.0f, -1.0f}, {1.0f, 1.0f}, {-1.0f, 1.0f}};
+  for (const float *pCorner : corners) {
+    *pVertices++ = pCorner[0];
+    *pVertices++ = pCorner[1];
+    *pVertices++ = 0.0f;
+    *pVertices++ = 0.0f;
+    *pVertices++ = 0.0f;
+    *pVertices++ = -1.0f;
+  }
+  const uint16_t indices[gImpostorIndexCount] = {0, 1, 2, 0, 2, 3};
+  memcpy(pIndices, indices, sizeof(indices));
+}
+
+void addInstanceBuffers(uint32_t count) {
+  // One persistently mapped buffer per frame in flight, one slot per sphere.
+  BufferLoadDesc instanceDesc = {};
+  instanceDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_BUFFER;
+  instanceDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+  instanceDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+  instanceDesc.mDesc.mFirstElement = 0;
+  instanceDesc.mDesc.mElementCount = count;
+  instanceDesc.mDesc.mStructStride = sizeof(SphereInstance);
+  instanceDesc.mDesc.mSize = sizeof(SphereInstance) * count;
+  instanceDesc.pData = nullptr;
+  for (uint32_t i = 0; i < gImageCount; ++i) {
+    instanceDesc.ppBuffer = &pInstanceBuffer[i];
+    addResource(&instanceDesc, nullptr);
+  }
+
+  // Written by the update compute pass, read by the indirect draws. Each LOD
+  // appends to its own region of count records.
+  BufferLoadDesc visibleDesc = {};
+  visibleDesc.mDesc.mDescriptors =
+      DESCRIPTOR_TYPE_BUFFER | DESCRIPTOR_TYPE_RW_BUFFER;
+  visibleDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+  visibleDesc.mDesc.mStartState = RESOURCE_STATE_SHADER_RESOURCE;
+  visibleDesc.mDesc.mFirstElement = 0;
+  visibleDesc.mDesc.mElementCount = count * gSphereLodCount;
+  visibleDesc.mDesc.mStructStride = sizeof(SphereInstance);
+  visibleDesc.mDesc.mSize = sizeof(SphereInstance) * count * gSphereLodCount;
+  visibleDesc.pData = nullptr;
+  for (uint32_t i = 0; i < gImageCount; ++i) {
+    visibleDesc.ppBuffer = &pVisibleInstanceBuffer[i];
+    addResource(&visibleDesc, nullptr);
+  }
+  waitForAllResourceLoads();
+
+  for (uint32_t i = 0; i < gImageCount; ++i) {
+    DescriptorData params[2] = {};
+    params[0].pName = "frameBlock";
+    params[0].ppBuffers = &pFrameUniformBuffer[i];
+    params[1].pName = "instanceBuffer";
+    params[1].ppBuffers = &pInstanceBuffer[i];
+    updateDescriptorSet(pRenderer, i, pDescriptorSetUniforms, 2, params);
+    params[1].ppBuffers = &pVisibleInstanceBuffer[i];
+    updateDescriptorSet(pRenderer, i, pDescriptorSetGpuDriven, 2, params);
+  }
+}
+
+void removeInstanceBuffers() {
+  for (uint32_t i = 0; i < gImageCount; ++i) {
+    if (pInstanceBuffer[i])
+      removeResource(pInstanceBuffer[i]);
+    pInstanceBuffer[i] = nullptr;
+    if (pVisibleInstanceBuffer[i])
+      removeResource(pVisibleInstanceBuffer[i]);
+    pVisibleInstanceBuffer[i] = nullptr;
+  }
+}
+
+// Copies the CPU sphere state into a new GPU sphere buffer, so the GPU-driven
+// path carries on from where the CPU path left off. The GPU must be idle.
+void addGpuSphereBuffer() {
+  GpuSphere *pSphereData =
+      (GpuSphere *)tf_memalign(16, gSphereCount * sizeof(GpuSphere));
+  for (uint32_t i = 0; i < gSphereCount; ++i) {
+    pSphereData[i].mPosition =
+        float3(gSpheres.pX[i], gSpheres.pY[i], gSpheres.pZ[i]);
+    pSphereData[i].mColor = gSpheres.pColor[i];
+  }
+
+  BufferLoadDesc sphereDesc = {};
+  sphereDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_RW_BUFFER;
+  sphereDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+  sphereDesc.mDesc.mStartState = RESOURCE_STATE_UNORDERED_ACCESS;
+  sphereDesc.mDesc.mFirstElement = 0;
+  sphereDesc.mDesc.mElementCount = gSphereCount;
+  sphereDesc.mDesc.mStructStride = sizeof(GpuSphere);
+  sphereDesc.mDesc.mSize = sizeof(GpuSphere) * gSphereCount;
+  sphereDesc.pData = pSphereData;
+  sphereDesc.ppBuffer = &pGpuSphereBuffer;
+  addResource(&sphereDesc, nullptr);
+  waitForAllResourceLoads();
+  tf_free(pSphereData);
+
+  for (uint32_t i = 0; i < gImageCount; ++i) {
+    DescriptorData params[4] = {};
+    params[0].pName = "updateBlock";
+    params[0].ppBuffers = &pUpdateUniformBuffer[i];
+    params[1].pName = "sphereState";
+    params[1].ppBuffers = &pGpuSphereBuffer;
+    params[2].pName = "visibleInstances";
+    params[2].ppBuffers = &pVisibleInstanceBuffer[i];
+    params[3].pName = "drawArgs";
+    params[3].ppBuffers = &pDrawArgsBuffer[i];
+    updateDescriptorSet(pRenderer, i, pDescriptorSetUpdate, 4, params);
+  }
+}
+
+void removeGpuSphereBuffer() {
+  if (pGpuSphereBuffer)
+    removeResource(pGpuSphereBuffer);
+  pGpuSphereBuffer = nullptr;
+}
+
+// Copies the GPU sphere state back into gSpheres, the other way from
+// addGpuSphereBuffer, so the CPU path carries on from where the GPU-driven
+// path left off. Waits for the GPU.
+void readBackGpuSpheres() {
+  waitQueueIdle(pGraphicsQueue);
+
+  const uint64_t size = sizeof(GpuSphere) * gSphereCount;
+  Buffer *pReadbackBuffer = nullptr;
+  BufferLoadDesc readbackDesc = {};
+  readbackDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_TO_CPU;
+  readbackDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+  readbackDesc.mDesc.mStartState = RESOURCE_STATE_COPY_DEST;
+  readbackDesc.mDesc.mSize = size;
+  readbackDesc.ppBuffer = &pReadbackBuffer;
+  addResource(&readbackDesc, nullptr);
+  waitForAllResourceLoads();
+
+  // The queue is idle, so this frame's cmd is free until Draw resets it.
+  resetCmdPool(pRenderer, pCmdPools[gFrameIndex]);
+  Cmd *pCmd = pCmds[gFrameIndex];
+  beginCmd(pCmd);
+  BufferBarrier barrier = {pGpuSphereBuffer, RESOURCE_STATE_UNORDERED_ACCESS,
+                           RESOURCE_STATE_COPY_SOURCE};
+  cmdResourceBarrier(pCmd, 1, &barrier, 0, nullptr, 0, nullptr);
+  cmdUpdateBuffer(pCmd, pReadbackBuffer, 0, pGpuSphereBuffer, 0, size);
+  barrier = {pGpuSphereBuffer, RESOURCE_STATE_COPY_SOURCE,
+             RESOURCE_STATE_UNORDERED_ACCESS};
+  cmdResourceBarrier(pCmd, 1, &barrier, 0, nullptr, 0, nullptr);
+  endCmd(pCmd);
+
+  QueueSubmitDesc submitDesc = {};
+  submitDesc.mCmdCount = 1;
+  submitDesc.ppCmds = &pCmd;
+  queueSubmit(pGraphicsQueue, &submitDesc);
+  waitQueueIdle(pGraphicsQueue);
+
+  const GpuSphere *pSphereData =
+      (const GpuSphere *)pReadbackBuffer->pCpuMappedAddress;
+  for (uint32_t i = 0; i < gSphereCount; ++i) {
+    gSpheres.pX[i] = pSphereData[i].mPosition.x;
+    gSpheres.pY[i] = pSphereData[i].mPosition.y;
+    gSpheres.pZ[i] = pSphereData[i].mPosition.z;
+    gSpheres.pColor[i] = pSphereData[i].mColor;
+  }
+  removeResource(pReadbackBuffer);
+}
+
+// Records one draw per visible sphere for the gathered instances
+// [begin, end). The sphere pipeline, buffers and descriptor set must be bound.
+// Impostors come last and switch to the impostor pipeline.
+void recordSphereDraws(Cmd *pCmd, uint32_t begin, uint32_t end) {
+  for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+    const SphereLod &lod = gSphereLods[l];
+    const uint32_t lodBegin = gLodInstanceOffset[l];
+    const uint32_t lodEnd = lodBegin + gLodVisibleCount[l];
+    const uint32_t first = begin > lodBegin ? begin : lodBegin;
+    const uint32_t last = end < lodEnd ? end : lodEnd;
+    if (l == gSphereImpostorLod && first < last)
+      cmdBindPipeline(pCmd, pImpostorPipeline);
+    for (uint32_t i = first; i < last; i++) {
+      cmdBindPushConstants(pCmd, pRootSignature, "sphereRootConstant", &i);
+      cmdDrawIndexed(pCmd, lod.mIndexCount, lod.mFirstIndex, lod.mVertexOffset);
+    }
+  }
+}
+
+void bindSpherePipeline(Cmd *pCmd) {
+  const uint32_t sphereVbStride = sizeof(float) * 6;
+  cmdBindPipeline(pCmd, pPipeline);
+  cmdBindVertexBuffer(pCmd, 1, &pVertexBuffer, &sphereVbStride, nullptr);
+  cmdBindIndexBuffer(pCmd, pIndexBuffer, INDEX_TYPE_UINT16, 0);
+}
+
+inline void beginDrawStats(Cmd *pCmd, uint32_t query) {
+  if (!pDrawStatsPools[gFrameIndex])
+    return;
+  QueryDesc queryDesc = {query};
+  cmdBeginQuery(pCmd, pDrawStatsPools[gFrameIndex], &queryDesc);
+}
+
+inline void endDrawStats(Cmd *pCmd, uint32_t query) {
+  if (!pDrawStatsPools[gFrameIndex])
+    return;
+  QueryDesc queryDesc = {query};
+  cmdEndQuery(pCmd, pDrawStatsPools[gFrameIndex], &queryDesc);
+}
+
+struct DrawRecordData {
+  RenderTarget *pRenderTarget;
+  uint32_t mDrawsPerCmd;
+};
+
+// RangeTaskFunc recording draws [begin, end) into their own cmd. Chunks are
+// exactly mDrawsPerCmd long, so each maps to one cmd.
+void recordSphereDrawRange(void *pData, uint32_t begin, uint32_t end) {
+  auto pRecord = static_cast<DrawRecordData *>(pData);
+  const uint32_t cmdIndex = begin / pRecord->mDrawsPerCmd;
+  resetCmdPool(pRenderer, pDrawCmdPools[gFrameIndex][cmdIndex]);
+  Cmd *pCmd = pDrawCmds[gFrameIndex][cmdIndex];
+  beginCmd(pCmd);
+
+  RenderTarget *pRenderTarget = pRecord->pRenderTarget;
+  LoadActionsDesc loadActions = {};
+  loadActions.mLoadActionsColor[0] = LOAD_ACTION_LOAD;
+  loadActions.mLoadActionDepth = LOAD_ACTION_LOAD;
+  cmdBindRenderTargets(pCmd, 1, &pRenderTarget, pDepthBuffer, &loadActions,
+                       nullptr, nullptr, -1, -1);
+  cmdSetViewport(pCmd, 0.0f, 0.0f, (float)pRenderTarget->mWidth,
+                 (float)pRenderTarget->mHeight, 0.0f, 1.0f);
+  cmdSetScissor(pCmd, 0, 0, pRenderTarget->mWidth, pRenderTarget->mHeight);
+
+  beginDrawStats(pCmd, cmdIndex);
+  bindSpherePipeline(pCmd);
+  cmdBindDescriptorSet(pCmd, gFrameIndex, pDescriptorSetUniforms);
+  recordSphereDraws(pCmd, begin, end);
+  endDrawStats(pCmd, cmdIndex);
+
+  cmdBindRenderTargets(pCmd, 0, nullptr, nullptr, nullptr, nullptr, nullptr,
+                       -1, -1);
+  endCmd(pCmd);
+}
+
+bool parallelRecordingEnabled() {
+  return !gGpuDrivenActive && gRenderMode == RENDER_MODE_PER_DRAW &&
+         gParallelRecording;
+}
+
+// Records the per-draw sphere draws across the ThreadSystem workers and the
+// main thread, on the threads a split step leaves free. Writes the recorded
+// cmds, in submission order, to ppCmds and returns how many there are.
+uint32_t recordSphereDrawsParallel(RenderTarget *pRenderTarget, Cmd **ppCmds) {
+  if (gSphereStepPending && gStepOrder == STEP_ORDER_WAIT)
+    waitParallelFor(&gSphereStepJob);
+
+  const uint32_t threadCount = getThreadSystemThreadCount(pThreadSystem) + 1;
+  uint32_t recordThreads = threadCount;
+  if (gSphereStepPending && gSphereStepThreads < threadCount)
+    recordThreads = threadCount - gSphereStepThreads;
+  uint32_t cmdCount = recordThreads;
+  if (cmdCount > gMaxDrawCmdCount)
+    cmdCount = gMaxDrawCmdCount;
+  const uint32_t maxUsefulCmds =
+      (gVisibleSphereCount + gMinDrawsPerCmd - 1) / gMinDrawsPerCmd;
+  if (cmdCount > maxUsefulCmds)
+    cmdCount = maxUsefulCmds;
+  if (cmdCount == 0)
+    return 0;
+
+  DrawRecordData data = {pRenderTarget,
+                         (gVisibleSphereCount + cmdCount - 1) / cmdCount};
+  cmdCount = (gVisibleSphereCount + data.mDrawsPerCmd - 1) / data.mDrawsPerCmd;
+  parallelFor(pThreadSystem, recordSphereDrawRange, &data, gVisibleSphereCount,
+              data.mDrawsPerCmd, recordThreads);
+
+  for (uint32_t c = 0; c < cmdCount; ++c)
+    ppCmds[c] = pDrawCmds[gFrameIndex][c];
+  return cmdCount;
+}
+
+// Hot-path counters of the current frame, reset at the start of Update and
+// shown under the sphere stats. Respawns are only known on the CPU path.
+struct FrameStats {
+  uint32_t mRespawns;
+  uint32_t mDrawCalls;
+  uint32_t mDescriptorBinds;
+  uint32_t mUploadBytes;
+  float mFenceWaitMs;
+  float mAcquireWaitMs;
+  // Part of mFenceWaitMs spent in the frame pacing wait.
+  float mPacingWaitMs;
+  float mLateStartWaitMs;
+};
+
+FrameStats gFrameStats = {};
+
+// Frame pacing. Update starts by waiting until at most gMaxFramesInFlight - 1
+// earlier frames are still on the GPU and only then samples input, so fewer
+// frames in flight trade throughput for latency. A frame's latency runs from
+// that input sample to the first time its fence is seen signalled, by a wait
+// or by a poll at the start of Update, so it is an upper bound.
+uint32_t gMaxFramesInFlight = gImageCount;
+int64_t gFrameInputTime[gImageCount] = {};
+bool gFrameInFlight[gImageCount] = {};
+constexpr uint32_t gLatencyHistoryLength = 64;
+float gLatencyHistory[gLatencyHistoryLength] = {};
+uint32_t gLatencySampleCount = 0;
+
+// Late start: after the pacing wait, Update also sleeps until the GPU is
+// predicted to be gLateStartMarginMs short of finishing the frames queued
+// ahead, less the CPU time a frame takes from its input sample to its submit.
+// The frame then reaches the GPU as it goes idle, with input sampled as late
+// as that allows. The prediction adds the smoothed GPU frame time, from the
+// frame timestamps, to the busy-until time at each submit.
+bool gLateStart = false;
+constexpr float gLateStartMarginMs = 1.0f;
+constexpr float gFrameTimeSmoothing = 0.1f;
+float gGpuFrameMs = 0.0f;
+float gCpuFrameMs = 0.0f;
+int64_t gGpuBusyUntil = 0;
+// gGpuBusyUntil as predicted when each frame was submitted.
+int64_t gFrameGpuDoneEstimate[gImageCount] = {};
+
+inline void smoothFrameTime(float &smoothed, float ms) {
+  smoothed = smoothed > 0.0f ? smoothed + (ms - smoothed) * gFrameTimeSmoothing
+                             : ms;
+}
+
+void completeFrame(uint32_t frameIndex) {
+  if (!gFrameInFlight[frameIndex])
+    return;
+  gFrameInFlight[frameIndex] = false;
+  const int64_t now = getUSec();
+  gLatencyHistory[gLatencySampleCount++ % gLatencyHistoryLength] =
+      (float)(now - gFrameInputTime[frameIndex]) / 1000.0f;
+
+  // A frame seen done before its predicted time moves the prediction for
+  // the frames after it forward by as much.
+  const int64_t early = gFrameGpuDoneEstimate[frameIndex] - now;
+  if (early > 0)
+    gGpuBusyUntil = gGpuBusyUntil - early > now ? gGpuBusyUntil - early : now;
+}
+
+// Called right after a frame is submitted, with its input sample time.
+void predictFrameDone(uint32_t frameIndex) {
+  const int64_t now = getUSec();
+  smoothFrameTime(gCpuFrameMs,
+                  (float)(now - gFrameInputTime[frameIndex]) / 1000.0f);
+  gGpuBusyUntil = (gGpuBusyUntil > now ? gGpuBusyUntil : now) +
+                  (int64_t)(gGpuFrameMs * 1000.0f);
+  gFrameGpuDoneEstimate[frameIndex] = gGpuBusyUntil;
+}
+
+// Sleeps until the late start time, if it is still ahead, and returns how long
+// that took in ms.
+float waitForLateStart() {
+  const int64_t start = getUSec();
+  const int64_t startAt =
+      gGpuBusyUntil - (int64_t)((gCpuFrameMs + gLateStartMarginMs) * 1000.0f);
+  if (startAt <= start)
+    return 0.0f;
+  PROFILER_SET_CPU_SCOPE("Frame", "Late start", 0xFFE8E8);
+  // threadSleep can overshoot by a scheduler tick, so the last 2 ms spin.
+  if (startAt - start > 2000)
+    threadSleep((unsigned)((startAt - start - 2000) / 1000));
+  while (getUSec() < startAt)
+    _mm_pause();
+  return (float)(getUSec() - start) / 1000.0f;
+}
+
+// Records the latency of every in-flight frame that has finished since the
+// last call.
+void pollFrameCompletions() {
+  for (uint32_t i = 0; i < gImageCount; ++i) {
+    if (!gFrameInFlight[i])
+      continue;
+    FenceStatus fenceStatus;
+    getFenceStatus(pRenderer, pRenderCompleteFences[i], &fenceStatus);
+    if (fenceStatus == FENCE_STATUS_COMPLETE)
+      completeFrame(i);
+  }
+}
+
+float averageFrameLatencyMs() {
+  const uint32_t count = gLatencySampleCount < gLatencyHistoryLength
+                             ? gLatencySampleCount
+                             : gLatencyHistoryLength;
+  float sum = 0.0f;
+  for (uint32_t i = 0; i < count; ++i)
+    sum += gLatencyHistory[i];
+  return count > 0 ? sum / count : 0.0f;
+}
+
+// Wall time between the last gFrameTimeHistoryLength Updates, oldest first,
+// and how many of them fall in each gFrameTimeBucketMs wide bucket. The last
+// bucket also holds everything slower.
+constexpr uint32_t gFrameTimeHistoryLength = 240;
+constexpr uint32_t gFrameTimeBucketCount = 40;
+constexpr float gFrameTimeBucketMs = 1.0f;
+float gFrameTimeHistory[gFrameTimeHistoryLength] = {};
+float gFrameTimeBuckets[gFrameTimeBucketCount] = {};
+float gFrameTimePlotMin = 0.0f;
+float gFrameTimePlotMax = gFrameTimeBucketCount * gFrameTimeBucketMs;
+float gFrameTimeBucketMin = 0.0f;
+float gFrameTimeBucketMax = (float)gFrameTimeHistoryLength;
+float2 gFrameTimePlotSize = float2(0.0f, 80.0f);
+int64_t gLastUpdateStart = 0;
+
+void recordFrameTime(float ms) {
+  memmove(gFrameTimeHistory, gFrameTimeHistory + 1,
+          (gFrameTimeHistoryLength - 1) * sizeof(float));
+  gFrameTimeHistory[gFrameTimeHistoryLength - 1] = ms;
+
+  for (uint32_t b = 0; b < gFrameTimeBucketCount; ++b)
+    gFrameTimeBuckets[b] = 0.0f;
+  for (uint32_t f = 0; f < gFrameTimeHistoryLength; ++f) {
+    // Slots before the first frame are still empty.
+    if (gFrameTimeHistory[f] <= 0.0f)
+      continue;
+    uint32_t bucket = (uint32_t)(gFrameTimeHistory[f] / gFrameTimeBucketMs);
+    if (bucket >= gFrameTimeBucketCount)
+      bucket = gFrameTimeBucketCount - 1;
+    gFrameTimeBuckets[bucket] += 1.0f;
+  }
+}
+
+// Stall until the GPU has finished frame slot frameIndex. Update calls this
+// for the frame gMaxFramesInFlight back, so the CPU runs at most that many
+// frames ahead of the GPU.
+void waitForFrame(uint32_t frameIndex) {
+  Fence *pFence = pRenderCompleteFences[frameIndex];
+  FenceStatus fenceStatus;
+  getFenceStatus(pRenderer, pFence, &fenceStatus);
+  if (fenceStatus == FENCE_STATUS_INCOMPLETE) {
+    PROFILER_SET_CPU_SCOPE("Frame", "Fence wait", 0xFFE8E8);
+    const int64_t waitStart = getUSec();
+    waitForFences(pRenderer, 1, &pFence);
+    gFrameStats.mFenceWaitMs += (float)(getUSec() - waitStart) / 1000.0f;
+  }
+  completeFrame(frameIndex);
+}
+
+// Starts the step on at most maxThreads threads.
+void beginSphereStep(float dz, uint32_t grainSize, uint32_t maxThreads) {
+  gSphereStep = {gSpheres,    gNextSpheres, dz,          gRandomSeed,
+                 gSimFrame++, gSimdUpdate,  &gRespawnLog};
+  gSphereStepThreads = maxThreads;
+  beginParallelFor(&gSphereStepJob, pThreadSystem, stepSphereRange,
+                   &gSphereStep, gSphereCount, grainSize, maxThreads);
+  gSphereStepPending = true;
+}
+
+// Waits for the background step, if any, and makes its output the current
+// state. Anything that touches gSpheres outside Update must call this first.
+// Returns whether there was a step to finish.
+bool finishSphereStep() {
+  if (!gSphereStepPending)
+    return false;
+  waitParallelFor(&gSphereStepJob);
+  const SphereState previous = gSpheres;
+  gSpheres = gNextSpheres;
+  gNextSpheres = previous;
+  gSphereStepPending = false;
+  gFrameStats.mRespawns += sphereRespawnCount(gRespawnLog, gSphereCount);
+  return true;
+}
+
+// Logs the first sphere along the view direction, found with the grid and, as
+// a check, by testing every sphere. Nothing else uses the grid, so it is built
+// here rather than kept current every frame.
+void pickSphere() {
+  const mat4 view = pCameraController->getViewMatrix();
+  const vec3 position = pCameraController->getViewPosition();
+  const vec3 forward = normalize(view.getRow(2).getXYZ());
+  const float3 origin(position.getX(), position.getY(), position.getZ());
+  const float3 dir(forward.getX(), forward.getY(), forward.getZ());
+  const float maxT = 4.0f * gSpawnDistance;
+
+  // The GPU path keeps the spheres on the GPU, and a pending step's output is
+  // what the next frame shows.
+  if (gGpuDrivenActive)
+    readBackGpuSpheres();
+  SphereState spheres = gSpheres;
+  if (gSphereStepPending) {
+    waitParallelFor(&gSphereStepJob);
+    spheres = gNextSpheres;
+  }
+
+  const int64_t buildStart = getUSec();
+  SphereGrid grid = {};
+  initSphereGrid(grid, spheres, gSphereCount);
+
+  uint32_t gridSphere = UINT32_MAX, scanSphere = UINT32_MAX;
+  float gridT = 0.0f, scanT = 0.0f;
+  const int64_t gridStart = getUSec();
+  queryGridRay(grid, spheres, origin, dir, maxT, gSphereRadius, &gridSphere,
+               &gridT);
+  const int64_t scanStart = getUSec();
+  raycastSpheres(spheres, gSphereCount, origin, dir, maxT, gSphereRadius,
+                 &scanSphere, &scanT);
+  const int64_t scanEnd = getUSec();
+  exitSphereGrid(grid);
+
+  if (gridSphere == UINT32_MAX)
+    LOGF(LogLevel::eINFO, "Pick: no sphere hit");
+  else
+    LOGF(LogLevel::eINFO, "Pick: sphere %u at distance %.2f", gridSphere,
+         gridT);
+  LOGF(LogLevel::eINFO,
+       "Pick: grid build %lld us, grid query %lld us, full scan %lld us%s",
+       (long long)(gridStart - buildStart), (long long)(scanStart - gridStart),
+       (long long)(scanEnd - scanStart),
+       gridSphere == scanSphere ? "" : ", results differ");
+}
+
+// Makes spheres, which it takes ownership of, the current state and sizes
+// everything that follows the sphere count to match.
+void setSphereState(const SphereState &spheres, uint32_t count) {
+  freeSphereState(gSpheres);
+  gSpheres = spheres;
+  freeSphereState(gNextSpheres);
+  gNextSpheres = allocSphereState(count);
+
+  tf_free(gRespawnLog.pSpheres);
+  gRespawnLog.pSpheres = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  tf_free(gRespawnLog.pBlockCount);
+  gRespawnLog.pBlockCount =
+      (uint32_t *)tf_calloc(sphereBlockCount(count), sizeof(uint32_t));
+
+  tf_free(gSphereLod);
+  gSphereLod = (uint8_t *)tf_malloc(count);
+  tf_free(gBlockLodCount);
+  gBlockLodCount = (uint32_t *)tf_calloc(
+      sphereBlockCount(count) * gSphereLodCount, sizeof(uint32_t));
+  tf_free(gBlockLodOffset);
+  gBlockLodOffset = (uint32_t *)tf_calloc(
+      sphereBlockCount(count) * gSphereLodCount, sizeof(uint32_t));
+  tf_free(gSphereDepth);
+  gSphereDepth = (uint16_t *)tf_malloc(count * sizeof(uint16_t));
+  tf_free(gSortKeys);
+  gSortKeys = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  tf_free(gSortSpheres);
+  gSortSpheres = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  freeRadixSortScratch(gSortScratch);
+  gSortScratch = allocRadixSortScratch(count);
+  gVisibleSphereCount = 0;
+  for (uint32_t l = 0; l < gSphereLodCount; ++l)
+    gLodVisibleCount[l] = 0;
+  gSphereCount = count;
+}
+
+// CPU side of setSphereCount. New spheres are spawned on the workers.
+void resizeSphereState(uint32_t count) {
+  SphereState spheres = allocSphereState(count);
+  const uint32_t kept = count < gSphereCount ? count : gSphereCount;
+  if (kept > 0)
+    copySphereState(spheres, gSpheres, kept);
+  if (count > kept) {
+    SphereSpawn spawn = {spheres, kept, gRandomSeed, gSimFrame};
+    parallelFor(pThreadSystem, spawnSphereRange, &spawn, count - kept,
+                gSphereSpawnGrainSize);
+  }
+  setSphereState(spheres, count);
+}
+
+// GPU side of setSphereCount, after resizeSphereState.
+void resizeSphereBuffers(uint32_t count) {
+  removeInstanceBuffers();
+  addInstanceBuffers(count);
+  if (gGpuDrivenActive) {
+    removeGpuSphereBuffer();
+    addGpuSphereBuffer();
+  }
+}
+
+// Resizes the CPU and GPU sphere storage. Spheres that survive the resize keep
+// their state, new ones are spawned right away. The GPU must be idle.
+void setSphereCount(uint32_t count) {
+  if (count == gSphereCount)
+    return;
+
+  finishSphereStep();
+  if (gGpuDrivenActive)
+    readBackGpuSpheres();
+  resizeSphereState(count);
+  resizeSphereBuffers(count);
+  LOGF(LogLevel::eINFO, "Sphere count set to %u", count);
+}
+
+// Offscreen benchmark. --benchmark N renders N frames, after a short warm-up,
+// to an offscreen target with a fixed timestep and writes per-stage timings
+// to --benchmark-output, as JSON if the name ends in .json and CSV otherwise.
+// There is no swapchain and the window is hidden, but the platform layer
+// still creates it. Only the DX12 backend is built, so this needs a GPU.
+// Comparing gpu_draw and overdraw, the pixel shader invocations of the sphere
+// draws per target pixel, with and without --front-to-back shows what the
+// sorted order saves in fragment work. With --per-draw, comparing cpu_record and
+// cpu_frame over --step-order shared, wait and split shows how recording
+// should share the workers with the pipelined step.
+enum BenchmarkStage : uint32_t {
+  BENCHMARK_STAGE_CPU_FRAME = 0,
+  BENCHMARK_STAGE_CPU_UPDATE,
+  BENCHMARK_STAGE_CPU_UPLOAD,
+  BENCHMARK_STAGE_CPU_RECORD,
+  BENCHMARK_STAGE_GPU_FRAME,
+  BENCHMARK_STAGE_GPU_UPDATE,
+  BENCHMARK_STAGE_GPU_DRAW,
+  BENCHMARK_STAGE_COUNT
+};
+
+const char *gBenchmarkStageNames[BENCHMARK_STAGE_COUNT] = {
+    "cpu_frame", "cpu_update", "cpu_upload", "cpu_record_submit",
+    "gpu_frame", "gpu_update", "gpu_draw"};
+
+// GPU timestamps written each benchmark frame.
+enum GpuTimestamp : uint32_t {
+  GPU_TIMESTAMP_FRAME_BEGIN = 0,
+  GPU_TIMESTAMP_UPDATE_END,
+  GPU_TIMESTAMP_DRAW_END,
+  GPU_TIMESTAMP_FRAME_END,
+  GPU_TIMESTAMP_COUNT
+};
+
+constexpr uint32_t gBenchmarkWarmupFrames = 16;
+uint32_t gBenchmarkFrames = 0;
+float gBenchmarkDeltaTime = 1.0f / 60.0f;
+const char *gBenchmarkOutput = "benchmark.csv";
+uint32_t gBenchmarkFrame = 0;
+float *gBenchmarkSamples[BENCHMARK_STAGE_COUNT] = {};
+uint32_t gBenchmarkSampleCount[BENCHMARK_STAGE_COUNT] = {};
+// Overdraw of each benchmark frame, see pDrawStatsPools.
+float *gOverdrawSamples = nullptr;
+uint32_t gOverdrawSampleCount = 0;
+int64_t gBenchmarkFrameStart = 0;
+
+RenderTarget *pOffscreenTarget = nullptr;
+QueryPool *pTimestampPool = nullptr;
+Buffer *pTimestampReadbackBuffer = nullptr;
+double gTimestampFrequency = 0.0;
+// Benchmark frame whose timestamps are in flight for each frame index, or
+// UINT32_MAX.
+uint32_t gTimestampFrame[gImageCount] = {};
+
+inline bool benchmarkEnabled() { return gBenchmarkFrames > 0; }
+
+void addBenchmarkSample(BenchmarkStage stage, uint32_t frame, float ms) {
+  if (frame < gBenchmarkWarmupFrames)
+    return;
+  if (gBenchmarkSampleCount[stage] < gBenchmarkFrames)
+    gBenchmarkSamples[stage][gBenchmarkSampleCount[stage]++] = ms;
+}
+
+inline float usecToMs(int64_t usec) { return (float)usec / 1000.0f; }
+
+// Reads back the GPU timestamps of the frame that last used frameIndex into
+// gGpuFrameMs and, when benchmarking, the samples and draw statistics. Its
+// fence must have been seen signalled.
+void collectGpuQueries(uint32_t frameIndex) {
+  if (gTimestampFrame[frameIndex] == UINT32_MAX)
+    return;
+
+  const uint64_t *pTicks =
+      (const uint64_t *)pTimestampReadbackBuffer->pCpuMappedAddress +
+      frameIndex * GPU_TIMESTAMP_COUNT;
+  auto ticksToMs = [](uint64_t begin, uint64_t end) {
+    return (float)((double)(end - begin) * 1000.0 / gTimestampFrequency);
+  };
+  const uint32_t frame = gTimestampFrame[frameIndex];
+  gTimestampFrame[frameIndex] = UINT32_MAX;
+  const float gpuFrameMs = ticksToMs(pTicks[GPU_TIMESTAMP_FRAME_BEGIN],
+                                     pTicks[GPU_TIMESTAMP_FRAME_END]);
+  smoothFrameTime(gGpuFrameMs, gpuFrameMs);
+  if (!benchmarkEnabled())
+    return;
+
+  addBenchmarkSample(BENCHMARK_STAGE_GPU_FRAME, frame, gpuFrameMs);
+  addBenchmarkSample(BENCHMARK_STAGE_GPU_UPDATE, frame,
+                     ticksToMs(pTicks[GPU_TIMESTAMP_FRAME_BEGIN],
+                               pTicks[GPU_TIMESTAMP_UPDATE_END]));
+  addBenchmarkSample(BENCHMARK_STAGE_GPU_DRAW, frame,
+                     ticksToMs(pTicks[GPU_TIMESTAMP_UPDATE_END],
+                               pTicks[GPU_TIMESTAMP_DRAW_END]));
+
+  // Frames where no pixel shader ran add no sample, which also leaves out a
+  // backend that does not fill in the statistics.
+  const uint64_t *pStats =
+      (const uint64_t *)pDrawStatsReadbackBuffers[frameIndex]->pCpuMappedAddress;
+  uint64_t psInvocations = 0;
+  for (uint32_t q = 0; q < gDrawStatsCount[frameIndex]; ++q)
+    psInvocations +=
+        pStats[q * gPipelineStatsCount + gPipelineStatsPsInvocations];
+  const double pixels =
+      (double)pOffscreenTarget->mWidth * pOffscreenTarget->mHeight;
+  if (psInvocations > 0 && frame >= gBenchmarkWarmupFrames &&
+      gOverdrawSampleCount < gBenchmarkFrames)
+    gOverdrawSamples[gOverdrawSampleCount++] =
+        (float)((double)psInvocations / pixels);
+}
+
+// collectGpuQueries for every frame seen done since the last call.
+void collectCompletedGpuQueries() {
+  for (uint32_t i = 0; i < gImageCount; ++i) {
+    if (!gFrameInFlight[i])
+      collectGpuQueries(i);
+  }
+}
+
+inline void writeGpuTimestamp(Cmd *pCmd, uint32_t frameIndex,
+                              GpuTimestamp timestamp) {
+  QueryDesc queryDesc = {frameIndex * GPU_TIMESTAMP_COUNT + timestamp};
+  cmdEndQuery(pCmd, pTimestampPool, &queryDesc);
+}
+
+// Wall time of each part of Init. The initial spheres are spawned on the
+// workers while the renderer is set up, so STARTUP_STAGE_SPHERE_SPAWN_WAIT is
+// only the part of the spawn the earlier stages did not hide, and is part of
+// STARTUP_STAGE_SPHERES.
+// STARTUP_STAGE_PIPELINES also takes in the draw pipeline built by the first
+// Load, which runs after Init.
+enum StartupStage : uint32_t {
+  STARTUP_STAGE_RENDERER = 0,
+  STARTUP_STAGE_GEOMETRY,
+  STARTUP_STAGE_SHADERS,
+  STARTUP_STAGE_PIPELINES,
+  STARTUP_STAGE_BUFFERS,
+  STARTUP_STAGE_UI,
+  STARTUP_STAGE_RESOURCE_LOADS,
+  STARTUP_STAGE_SPHERES,
+  STARTUP_STAGE_SPHERE_SPAWN_WAIT,
+  STARTUP_STAGE_TOTAL,
+  STARTUP_STAGE_COUNT
+};
+
+const char *gStartupStageNames[STARTUP_STAGE_COUNT] = {
+    "renderer", "geometry",       "shaders", "pipelines",         "buffers",
+    "ui",       "resource_loads", "spheres", "sphere_spawn_wait", "total"};
+
+float gStartupMs[STARTUP_STAGE_COUNT] = {};
+int64_t gStartupStageStart = 0;
+// The initial spheres, spawned by gInitialSphereJob into a state of their own
+// and made current by Init once the job is done.
+SphereSpawn gInitialSpawn = {};
+BackgroundParallelFor gInitialSphereJob;
+
+// Ends the stage that started at the last call and starts the next one.
+void endStartupStage(StartupStage stage) {
+  const int64_t now = getUSec();
+  gStartupMs[stage] = usecToMs(now - gStartupStageStart);
+  gStartupStageStart = now;
+}
+
+// Every early return from Init goes through here, so the spawn job never
+// outlives a failed Init.
+bool failInit() {
+  waitParallelFor(&gInitialSphereJob);
+  freeSphereState(gInitialSpawn.mState);
+  gInitialSpawn.mState = {};
+  return false;
+}
+
+void logStartupTimes() {
+  for (uint32_t s = 0; s < STARTUP_STAGE_COUNT; ++s)
+    LOGF(LogLevel::eINFO, "Startup %-16s %8.2f ms", gStartupStageNames[s],
+         gStartupMs[s]);
+}
+
+// Pipeline cache, kept next to the compiled shaders that addShader already
+// caches. The file starts with a PipelineCacheHeader, and a cache written for
+// other shader sources is dropped. Pipeline names carry a hash of the target
+// formats they were built for, so one cache holds every variant.
+constexpr uint32_t gPipelineCacheMagic = 0x43504653; // "SFPC"
+constexpr uint32_t gPipelineCacheVersion = 1;
+const char *gPipelineCacheFileName = "sphere_forge.cache";
+const char *gShaderSourceNames[] = {
+    "basic.vert", "basic.frag", "sphere_update.comp", "sphere_impostor.vert",
+    "sphere_impostor.frag"};
+
+struct PipelineCacheHeader {
+  uint32_t mMagic;
+  uint32_t mVersion;
+  uint64_t mSourceHash;
+};
+
+PipelineCache *pPipelineCache = nullptr;
+uint64_t gShaderSourceHash = 0;
+// Whether a cache file was accepted. The driver still decides which pipelines
+// it can take from it, so this does not mean every pipeline was a hit.
+bool gPipelineCacheLoaded = false;
+// Target formats pPipeline was built for.
+uint64_t gPipelineFormatHash = 0;
+
+constexpr uint64_t gFnvOffsetBasis = 0xcbf29ce484222325ull;
+
+// 64-bit FNV-1a.
+uint64_t hashBytes(uint64_t hash, const void *pData, size_t size) {
+  const uint8_t *pBytes = (const uint8_t *)pData;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= pBytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+uint64_t hashShaderSources() {
+  uint64_t hash = gFnvOffsetBasis;
+  for (const char *pName : gShaderSourceNames) {
+    hash = hashBytes(hash, pName, strlen(pName));
+    FileStream stream = {};
+    if (!fsOpenStreamFromPath(RD_SHADER_SOURCES, pName, FM_READ_BINARY,
+                              &stream))
+      continue;
+    const size_t size = (size_t)fsGetStreamFileSize(&stream);
+    void *pSource = tf_malloc(size);
+    const size_t readSize = fsReadFromStream(&stream, pSource, size);
+    fsCloseStream(&stream);
+    hash = hashBytes(hash, pSource, readSize);
+    tf_free(pSource);
+  }
+  // SPHERE_LOD_COUNT is compiled into the update shader and SPHERE_RADIUS
+  // into the impostor shaders.
+  hash = hashBytes(hash, &gSphereLodCount, sizeof(gSphereLodCount));
+  return hashBytes(hash, &gSphereRadius, sizeof(gSphereRadius));
+}
+
+uint64_t hashPipelineFormats(const RenderTarget *pColorTarget,
+                             const RenderTarget *pDepthTarget) {
+  const uint32_t formats[] = {(uint32_t)pColorTarget->mFormat,
+                              (uint32_t)pColorTarget->mSampleCount,
+                              pColorTarget->mSampleQuality,
+                              (uint32_t)pDepthTarget->mFormat};
+  return hashBytes(gFnvOffsetBasis, formats, sizeof(formats));
+}
+
+// Creates pPipelineCache, from the cache file if it matches the shader
+// sources.
+void loadSpherePipelineCache() {
+  gShaderSourceHash = hashShaderSources();
+
+  PipelineCacheDesc cacheDesc = {};
+  void *pData = nullptr;
+  FileStream stream = {};
+  if (fsOpenStreamFromPath(RD_SHADER_BINARIES, gPipelineCacheFileName,
+                           FM_READ_BINARY, &stream)) {
+    const int64_t fileSize = fsGetStreamFileSize(&stream);
+    PipelineCacheHeader header = {};
+    if (fileSize > (int64_t)sizeof(header) &&
+        fsReadFromStream(&stream, &header, sizeof(header)) == sizeof(header) &&
+        header.mMagic == gPipelineCacheMagic &&
+        header.mVersion == gPipelineCacheVersion &&
+        header.mSourceHash == gShaderSourceHash) {
+      const size_t size = (size_t)fileSize - sizeof(header);
+      pData = tf_malloc(size);
+      if (fsReadFromStream(&stream, pData, size) == size) {
+        cacheDesc.pData = pData;
+        cacheDesc.mSize = size;
+      }
+    }
+    fsCloseStream(&stream);
+  }
+
+  gPipelineCacheLoaded = cacheDesc.pData != nullptr;
+  addPipelineCache(pRenderer, &cacheDesc, &pPipelineCache);
+  tf_free(pData);
+  LOGF(LogLevel::eINFO, "Pipeline cache %s, %zu bytes",
+       gPipelineCacheLoaded ? "loaded" : "not loaded", cacheDesc.mSize);
+}
+
+void saveSpherePipelineCache() {
+  size_t size = 0;
+  getPipelineCacheData(pRenderer, pPipelineCache, &size, nullptr);
+  if (size == 0)
+    return;
+  void *pData = tf_malloc(size);
+  getPipelineCacheData(pRenderer, pPipelineCache, &size, pData);
+
+  FileStream stream = {};
+  if (fsOpenStreamFromPath(RD_SHADER_BINARIES, gPipelineCacheFileName,
+                           FM_WRITE_BINARY, &stream)) {
+    const PipelineCacheHeader header = {gPipelineCacheMagic,
+                                        gPipelineCacheVersion,
+                                        gShaderSourceHash};
+    fsWriteToStream(&stream, &header, sizeof(header));
+    fsWriteToStream(&stream, pData, size);
+    fsCloseStream(&stream);
+  } else {
+    LOGF(LogLevel::eWARNING, "Could not write pipeline cache %s",
+         gPipelineCacheFileName);
+  }
+  tf_free(pData);
+}
+
+int compareFloat(const void *a, const void *b) {
+  const float fa = *(const float *)a;
+  const float fb = *(const float *)b;
+  return fa < fb ? -1 : (fa > fb ? 1 : 0);
+}
+
+struct BenchmarkStats {
+  float mMin;
+  float mMedian;
+  float mP99;
+};
+
+BenchmarkStats computeBenchmarkStats(float *pSamples, uint32_t count) {
+  BenchmarkStats stats = {};
+  if (count == 0)
+    return stats;
+  qsort(pSamples, count, sizeof(float), compareFloat);
+  stats.mMin = pSamples[0];
+  stats.mMedian = pSamples[count / 2];
+  stats.mP99 = pSamples[(count * 99 + 99) / 100 - 1];
+  return stats;
+}
+
+bool writeBenchmarkResults(const char *pPath) {
+  FILE *pFile = fopen(pPath, "w");
+  if (!pFile) {
+    LOGF(LogLevel::eERROR, "Could not open benchmark output %s", pPath);
+    return false;
+  }
+
+  const size_t pathLength = strlen(pPath);
+  const bool json =
+      pathLength >= 5 && strcmp(pPath + pathLength - 5, ".json") == 0;
+  if (json) {
+    fprintf(pFile,
+            "{\n  \"frames\": %u,\n  \"spheres\": %u,\n"
+            "  \"gpu_driven\": %s,\n  \"front_to_back\": %s,\n"
+            "  \"render_mode\": \"%s\",\n  \"step_order\": \"%s\",\n"
+            "  \"frames_in_flight\": %u,\n  \"late_start\": %s,\n"
+            "  \"latency_upper_bound_ms\": %.3f,\n"
+            "  \"impostor_distance\": %g,\n"
+            "  \"delta_time\": %g,\n  \"pipeline_cache_loaded\": %s,\n"
+            "  \"startup_ms\": {",
+            gBenchmarkFrames, gSphereCount, gGpuDrivenActive ? "true" : "false",
+            gFrontToBack ? "true" : "false", gRenderModeNames[gRenderMode],
+            gStepOrderNames[gStepOrder], gMaxFramesInFlight,
+            gLateStart ? "true" : "false", averageFrameLatencyMs(),
+            gImpostors ? gImpostorDistance : 0.0f,
+            gBenchmarkDeltaTime, gPipelineCacheLoaded ? "true" : "false");
+    for (uint32_t s = 0; s < STARTUP_STAGE_COUNT; ++s) {
+      fprintf(pFile, "%s\"%s\": %.3f", s > 0 ? ", " : "",
+              gStartupStageNames[s], gStartupMs[s]);
+    }
+    fprintf(pFile, "},\n  \"stages\": [\n");
+  } else {
+    fprintf(pFile, "stage,samples,min_ms,median_ms,p99_ms\n");
+  }
+
+  for (uint32_t s = 0; s < BENCHMARK_STAGE_COUNT; ++s) {
+    const uint32_t count = gBenchmarkSampleCount[s];
+    BenchmarkStats stats = computeBenchmarkStats(gBenchmarkSamples[s], count);
+    if (json) {
+      fprintf(pFile,
+              "    {\"stage\": \"%s\", \"samples\": %u, \"min_ms\": %.4f, "
+              "\"median_ms\": %.4f, \"p99_ms\": %.4f}%s\n",
+              gBenchmarkStageNames[s], count, stats.mMin, stats.mMedian,
+              stats.mP99, s + 1 < BENCHMARK_STAGE_COUNT ? "," : "");
+    } else {
+      fprintf(pFile, "%s,%u,%.4f,%.4f,%.4f\n", gBenchmarkStageNames[s], count,
+              stats.mMin, stats.mMedian, stats.mP99);
+    }
+  }
+  BenchmarkStats overdraw =
+      computeBenchmarkStats(gOverdrawSamples, gOverdrawSampleCount);
+  if (json) {
+    fprintf(pFile,
+            "  ],\n  \"overdraw\": {\"samples\": %u, \"min\": %.4f, "
+            "\"median\": %.4f, \"p99\": %.4f}\n}\n",
+            gOverdrawSampleCount, overdraw.mMin, overdraw.mMedian,
+            overdraw.mP99);
+  } else {
+    // Pixel shader invocations per pixel rather than ms.
+    fprintf(pFile, "overdraw,%u,%.4f,%.4f,%.4f\n", gOverdrawSampleCount,
+            overdraw.mMin, overdraw.mMedian, overdraw.mP99);
+    // One sample each, so min, median and p99 are the same.
+    for (uint32_t s = 0; s < STARTUP_STAGE_COUNT; ++s) {
+      fprintf(pFile, "startup_%s,1,%.4f,%.4f,%.4f\n", gStartupStageNames[s],
+              gStartupMs[s], gStartupMs[s], gStartupMs[s]);
+    }
+  }
+
+  fclose(pFile);
+  LOGF(LogLevel::eINFO, "Benchmark results written to %s", pPath);
+  return true;
+}
+
+class App : public IApp {
+  void parseCommandLine() {
+    for (int i = 1; i < argc; ++i) {
+      if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        gRandomSeed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+      else if (strcmp(argv[i], "--spheres") == 0 && i + 1 < argc)
+        gRequestedSphereCount = (uint32_t)strtoul(argv[++i], nullptr, 0);
+      else if (strcmp(argv[i], "--gpu-driven") == 0)
+        gGpuDriven = true;
+      else if (strcmp(argv[i], "--per-draw") == 0)
+        gRenderMode = RENDER_MODE_PER_DRAW;
+      else if (strcmp(argv[i], "--front-to-back") == 0)
+        gFrontToBack = true;
+      else if (strcmp(argv[i], "--impostor-distance") == 0 && i + 1 < argc) {
+        gImpostors = true;
+        gImpostorDistance = (float)atof(argv[++i]);
+      } else if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc)
+        gMaxFramesInFlight = (uint32_t)strtoul(argv[++i], nullptr, 0);
+      else if (strcmp(argv[i], "--late-start") == 0)
+        gLateStart = true;
+      else if (strcmp(argv[i], "--step-order") == 0 && i + 1 < argc) {
+        const char *pOrder = argv[++i];
+        for (uint32_t o = 0; o < STEP_ORDER_COUNT; ++o) {
+          if (strcmp(pOrder, gStepOrderNames[o]) == 0)
+            gStepOrder = o;
+        }
+      } else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc)
+        gBenchmarkFrames = (uint32_t)strtoul(argv[++i], nullptr, 0);
+      else if (strcmp(argv[i], "--benchmark-output") == 0 && i + 1 < argc)
+        gBenchmarkOutput = argv[++i];
+      else if (strcmp(argv[i], "--benchmark-dt") == 0 && i + 1 < argc)
+        gBenchmarkDeltaTime = (float)atof(argv[++i]);
+    }
+    if (gRequestedSphereCount < gMinSphereCount)
+      gRequestedSphereCount = gMinSphereCount;
+    if (gRequestedSphereCount > gMaxSphereCount)
+      gRequestedSphereCount = gMaxSphereCount;
+    if (gGpuDriven && !gGpuDrivenSupported) {
+      LOGF(LogLevel::eWARNING,
+           "--gpu-driven is only supported on DX12, using the CPU path");
+      gGpuDriven = false;
+    }
+    if (gMaxFramesInFlight < 1)
+      gMaxFramesInFlight = 1;
+    if (gMaxFramesInFlight > gImageCount)
+      gMaxFramesInFlight = gImageCount;
+  }
+
+  virtual bool Init() {
+    const int64_t startupStart = getUSec();
+    gStartupStageStart = startupStart;
+    parseCommandLine();
+
+    initThreadSystem(&pThreadSystem);
+    gInitialSpawn = {allocSphereState(gRequestedSphereCount), 0, gRandomSeed,
+                     gSimFrame};
+    beginParallelFor(&gInitialSphereJob, pThreadSystem, spawnSphereRange,
+                     &gInitialSpawn, gRequestedSphereCount,
+                     gSphereSpawnGrainSize);
+
+    // FILE PATHS
+    fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_SHADER_SOURCES,
+                            "Shaders");
+    fsSetPathForResourceDir(pSystemFileIO, RM_DEBUG, RD_SHADER_BINARIES,
+                            "CompiledShaders");
+    fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_GPU_CONFIG, "GPUCfg");
+    fsSetPathForResourceDir(pSystemFileIO, RM_CONTENT, RD_FONTS, "Fonts");
+
+    // window and renderer setup
+    RendererDesc settings = {0};
+    initRenderer(GetName(), &settings, &pRenderer);
+    // check for init success
+    if (!pRenderer)
+      return failInit();
+
+    QueueDesc queueDesc = {};
+    queueDesc.mType = QUEUE_TYPE_GRAPHICS;
+    queueDesc.mFlag = QUEUE_FLAG_INIT_MICROPROFILE;
+    addQueue(pRenderer, &queueDesc, &pGraphicsQueue);
+
+    for (uint32_t i = 0; i < gImageCount; ++i) {
+      CmdPoolDesc cmdPoolDesc = {};
+      cmdPoolDesc.pQueue = pGraphicsQueue;
+      addCmdPool(pRenderer, &cmdPoolDesc, &pCmdPools[i]);
+      CmdDesc cmdDesc = {};
+      cmdDesc.pPool = pCmdPools[i];
+      addCmd(pRenderer, &cmdDesc, &pCmds[i]);
+      addCmd(pRenderer, &cmdDesc, &pUiCmds[i]);
+
+      for (uint32_t c = 0; c < gMaxDrawCmdCount; ++c) {
+        addCmdPool(pRenderer, &cmdPoolDesc, &pDrawCmdPools[i][c]);
+        cmdDesc.pPool = pDrawCmdPools[i][c];
+        addCmd(pRenderer, &cmdDesc, &pDrawCmds[i][c]);
+      }
+
+      addFence(pRenderer, &pRenderCompleteFences[i]);
+      addSemaphore(pRenderer, &pRenderCompleteSemaphores[i]);
+    }
+    addSemaphore(pRenderer, &pImageAcquiredSemaphore);
+
+    initResourceLoaderInterface(pRenderer);
+    endStartupStage(STARTUP_STAGE_RENDERER);
+
+    uint32_t sphereVertexTotal = 0;
+    uint32_t sphereIndexTotal = 0;
+    for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+      SphereLod &lod = gSphereLods[l];
+      const bool impostor = l == gSphereImpostorLod;
+      lod.mIndexCount = impostor ? gImpostorIndexCount
+                                 : sphereIndexCount(lod.mSlices, lod.mStacks);
+      lod.mFirstIndex = sphereIndexTotal;
+      lod.mVertexOffset = sphereVertexTotal;
+      sphereVertexTotal += impostor
+                               ? gImpostorVertexCount
+                               : sphereVertexCount(lod.mSlices, lod.mStacks);
+      sphereIndexTotal += lod.mIndexCount;
+    }
+
+    float *pSphereVertices =
+        (float *)tf_malloc(sphereVertexTotal * 6 * sizeof(float));
+    uint16_t *pSphereIndices =
+        (uint16_t *)tf_malloc(sphereIndexTotal * sizeof(uint16_t));
+    for (uint32_t l = 0; l < gSphereMeshLodCount; ++l) {
+      const SphereLod &lod = gSphereLods[l];
+      generateSphereMesh(lod.mSlices, lod.mStacks, gSphereRadius,
+                         pSphereVertices + lod.mVertexOffset * 6,
+                         pSphereIndices + lod.mFirstIndex);
+    }
+    const SphereLod &impostorLod = gSphereLods[gSphereImpostorLod];
+    generateImpostorQuad(pSphereVertices + impostorLod.mVertexOffset * 6,
+                         pSphereIndices + impostorLod.mFirstIndex);
+
+    BufferLoadDesc sphereVbDesc = {};
+    sphereVbDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_VERTEX_BUFFER;
+    sphereVbDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+    sphereVbDesc.mDesc.mSize = sphereVertexTotal * 6 * sizeof(float);
+    sphereVbDesc.pData = pSphereVertices;
+    sphereVbDesc.ppBuffer = &pVertexBuffer;
+    addResource(&sphereVbDesc, nullptr);
+
+    BufferLoadDesc sphereIbDesc = {};
+    sphereIbDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_INDEX_BUFFER;
+    sphereIbDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+    sphereIbDesc.mDesc.mSize = sphereIndexTotal * sizeof(uint16_t);
+    sphereIbDesc.pData = pSphereIndices;
+    sphereIbDesc.ppBuffer = &pIndexBuffer;
+    addResource(&sphereIbDesc, nullptr);
+    endStartupStage(STARTUP_STAGE_GEOMETRY);
+
+    ShaderLoadDesc shaderDesc = {};
+    shaderDesc.mStages[0] = {"basic.vert", nullptr, 0};
+    shaderDesc.mStages[1] = {"basic.frag", nullptr, 0};
+    addShader(pRenderer, &shaderDesc, &pShader);
+
+    char radiusValue[16];
+    snprintf(radiusValue, sizeof(radiusValue), "%ff", gSphereRadius);
+    ShaderMacro impostorMacro = {"SPHERE_RADIUS", radiusValue};
+    ShaderLoadDesc impostorShaderDesc = {};
+    impostorShaderDesc.mStages[0] = {"sphere_impostor.vert", &impostorMacro, 1};
+    impostorShaderDesc.mStages[1] = {"sphere_impostor.frag", &impostorMacro, 1};
+    addShader(pRenderer, &impostorShaderDesc, &pImpostorShader);
+
+    Shader *shaders[] = {pShader, pImpostorShader};
+    RootSignatureDesc rootDesc = {};
+    rootDesc.mStaticSamplerCount = 0;
+    rootDesc.mShaderCount = 2;
+    rootDesc.ppShaders = shaders;
+    addRootSignature(pRenderer, &rootDesc, &pRootSignature);
+
+    char lodCountValue[8];
+    snprintf(lodCountValue, sizeof(lodCountValue), "%u", gSphereLodCount);
+    ShaderMacro updateMacro = {"SPHERE_LOD_COUNT", lodCountValue};
+    ShaderLoadDesc updateShaderDesc = {};
+    updateShaderDesc.mStages[0] = {"sphere_update.comp", &updateMacro, 1};
+    addShader(pRenderer, &updateShaderDesc, &pUpdateShader);
+
+    rootDesc.mShaderCount = 1;
+    rootDesc.ppShaders = &pUpdateShader;
+    addRootSignature(pRenderer, &rootDesc, &pUpdateRootSignature);
+
+    IndirectArgumentDescriptor drawArgDesc = {};
+    drawArgDesc.mType = INDIRECT_DRAW_INDEX;
+    CommandSignatureDesc drawSignatureDesc = {};
+    drawSignatureDesc.pRootSignature = pRootSignature;
+    drawSignatureDesc.mIndirectArgCount = 1;
+    drawSignatureDesc.pArgDescs = &drawArgDesc;
+    drawSignatureDesc.mPacked = true;
+    addIndirectCommandSignature(pRenderer, &drawSignatureDesc,
+                                &pDrawCommandSignature);
+
+    DescriptorSetDesc desc = {pRootSignature, DESCRIPTOR_UPDATE_FREQ_PER_FRAME,
+                              gImageCount};
+    addDescriptorSet(pRenderer, &desc, &pDescriptorSetUniforms);
+    addDescriptorSet(pRenderer, &desc, &pDescriptorSetGpuDriven);
+    desc = {pUpdateRootSignature, DESCRIPTOR_UPDATE_FREQ_PER_FRAME,
+            gImageCount};
+    addDescriptorSet(pRenderer, &desc, &pDescriptorSetUpdate);
+    endStartupStage(STARTUP_STAGE_SHADERS);
+
+    // The draw pipeline depends on the target formats, so Load builds it.
+    loadSpherePipelineCache();
+    PipelineDesc updateDesc = {};
+    updateDesc.mType = PIPELINE_TYPE_COMPUTE;
+    updateDesc.mComputeDesc.pShaderProgram = pUpdateShader;
+    updateDesc.mComputeDesc.pRootSignature = pUpdateRootSignature;
+    updateDesc.pCache = pPipelineCache;
+    updateDesc.pName = "sphere_update";
+    addPipeline(pRenderer, &updateDesc, &pUpdatePipeline);
+    endStartupStage(STARTUP_STAGE_PIPELINES);
+
+    BufferLoadDesc ubDesc = {};
+    ubDesc.mDesc.mDescriptors = DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    ubDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+    ubDesc.mDesc.mSize = sizeof(FrameUniformBlock);
+    ubDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+    ubDesc.pData = nullptr;
+    for (uint32_t i = 0; i < gImageCount; ++i) {
+      ubDesc.ppBuffer = &pFrameUniformBuffer[i];
+      addResource(&ubDesc, nullptr);
+    }
+    ubDesc.mDesc.mSize = sizeof(UpdateUniformBlock);
+    for (uint32_t i = 0; i < gImageCount; ++i) {
+      ubDesc.ppBuffer = &pUpdateUniformBuffer[i];
+      addResource(&ubDesc, nullptr);
+    }
+
+    // Indirect draw arguments, one set per LOD, are reset from
+    // pDrawArgsResetBuffer every frame before the update pass counts the
+    // visible spheres into them.
+    IndirectDrawIndexArguments drawArgsReset[gSphereLodCount] = {};
+    for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+      drawArgsReset[l].mIndexCount = gSphereLods[l].mIndexCount;
+      drawArgsReset[l].mStartIndex = gSphereLods[l].mFirstIndex;
+      drawArgsReset[l].mVertexOffset = gSphereLods[l].mVertexOffset;
+    }
+    BufferLoadDesc drawArgsResetDesc = {};
+    drawArgsResetDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+    drawArgsResetDesc.mDesc.mSize = sizeof(drawArgsReset);
+    drawArgsResetDesc.pData = drawArgsReset;
+    drawArgsResetDesc.ppBuffer = &pDrawArgsResetBuffer;
+    addResource(&drawArgsResetDesc, nullptr);
+
+    BufferLoadDesc drawArgsDesc = {};
+    drawArgsDesc.mDesc.mDescriptors =
+        DESCRIPTOR_TYPE_RW_BUFFER | DESCRIPTOR_TYPE_INDIRECT_BUFFER;
+    drawArgsDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_ONLY;
+    drawArgsDesc.mDesc.mStartState = RESOURCE_STATE_INDIRECT_ARGUMENT;
+    drawArgsDesc.mDesc.mFirstElement = 0;
+    drawArgsDesc.mDesc.mElementCount =
+        gSphereLodCount * sizeof(IndirectDrawIndexArguments) / sizeof(uint32_t);
+    drawArgsDesc.mDesc.mStructStride = sizeof(uint32_t);
+    drawArgsDesc.mDesc.mSize = sizeof(drawArgsReset);
+    drawArgsDesc.pData = nullptr;
+    for (uint32_t i = 0; i < gImageCount; ++i) {
+      drawArgsDesc.ppBuffer = &pDrawArgsBuffer[i];
+      addResource(&drawArgsDesc, nullptr);
+    }
+    endStartupStage(STARTUP_STAGE_BUFFERS);
+
+    if (!gAppUI.Init(pRenderer))
+      return failInit();
+
+    gAppUI.LoadFont("TitilliumText/TitilliumText-Bold.otf");
+
+    CameraMotionParameters cmp{160.0f, 600.0f, 200.0f};
+    vec3 lookAt{0, 0, 500};
+    vec3 camPos{0.0f, 0.0f, 0.0f};
+
+    pCameraController = createFpsCameraController(camPos, lookAt);
+
+    pCameraController->setMotionParameters(cmp);
+
+    if (!initInputSystem(pWindow))
+      return failInit();
+    // The benchmark never presents, so there is nothing to show.
+    if (benchmarkEnabled())
+      hideWindow(pWindow);
+
+    // Initialize microprofiler and it's UI.
+    initProfiler();
+
+    // Gpu profiler can only be added after initProfile.
+    gGpuProfileToken = addGpuProfiler(pRenderer, pGraphicsQueue, "Graphics");
+
+    // Frame timestamps feed the late start, so they are always written.
+    QueryPoolDesc queryPoolDesc = {};
+    queryPoolDesc.mType = QUERY_TYPE_TIMESTAMP;
+    queryPoolDesc.mQueryCount = GPU_TIMESTAMP_COUNT * gImageCount;
+    addQueryPool(pRenderer, &queryPoolDesc, &pTimestampPool);
+    getTimestampFrequency(pGraphicsQueue, &gTimestampFrequency);
+    for (uint32_t i = 0; i < gImageCount; ++i)
+      gTimestampFrame[i] = UINT32_MAX;
+
+    BufferLoadDesc readbackDesc = {};
+    readbackDesc.mDesc.mMemoryUsage = RESOURCE_MEMORY_USAGE_GPU_TO_CPU;
+    readbackDesc.mDesc.mFlags = BUFFER_CREATION_FLAG_PERSISTENT_MAP_BIT;
+    readbackDesc.mDesc.mStartState = RESOURCE_STATE_COPY_DEST;
+    readbackDesc.mDesc.mSize =
+        sizeof(uint64_t) * GPU_TIMESTAMP_COUNT * gImageCount;
+    readbackDesc.ppBuffer = &pTimestampReadbackBuffer;
+    addResource(&readbackDesc, nullptr);
+
+    if (benchmarkEnabled()) {
+      for (uint32_t s = 0; s < BENCHMARK_STAGE_COUNT; ++s)
+        gBenchmarkSamples[s] =
+            (float *)tf_malloc(gBenchmarkFrames * sizeof(float));
+
+      gOverdrawSamples = (float *)tf_malloc(gBenchmarkFrames * sizeof(float));
+      queryPoolDesc.mType = QUERY_TYPE_PIPELINE_STATISTICS;
+      queryPoolDesc.mQueryCount = gMaxDrawCmdCount;
+      readbackDesc.mDesc.mSize =
+          sizeof(uint64_t) * gPipelineStatsCount * gMaxDrawCmdCount;
+      for (uint32_t i = 0; i < gImageCount; ++i) {
+        addQueryPool(pRenderer, &queryPoolDesc, &pDrawStatsPools[i]);
+        readbackDesc.ppBuffer = &pDrawStatsReadbackBuffers[i];
+        addResource(&readbackDesc, nullptr);
+      }
+
+      LOGF(LogLevel::eINFO, "Benchmark: %u frames, dt %g, output %s",
+           gBenchmarkFrames, gBenchmarkDeltaTime, gBenchmarkOutput);
+    }
+
+    GuiDesc guiDesc = {};
+    guiDesc.mStartPosition =
+        vec2(mSettings.mWidth * 0.01f, mSettings.mHeight * 0.2f);
+    pGuiWindow = gAppUI.AddGuiComponent(GetName(), &guiDesc);
+
+    pGuiWindow->AddWidget(
+        CheckboxWidget("Toggle VSync\t\t\t\t\t", &bToggleVSync));
+    pGuiWindow->AddWidget(SliderUintWidget(
+        "Max Frames In Flight", &gMaxFramesInFlight, 1, gImageCount, 1));
+    pGuiWindow->AddWidget(CheckboxWidget("Late Start", &gLateStart));
+    pGuiWindow->AddWidget(DropdownWidget("Render Mode", &gRenderMode,
+                                         gRenderModeNames, gRenderModeValues,
+                                         RENDER_MODE_COUNT));
+    IWidget *pSphereCountWidget = pGuiWindow->AddWidget(
+        SliderUintWidget("Sphere Count", &gRequestedSphereCount,
+                         gMinSphereCount, gMaxSphereCount, 1024));
+    pSphereCountWidget->pOnDeactivatedAfterEdit = []() {
+      gSphereCountChanged = true;
+    };
+    pGuiWindow->AddWidget(
+        CheckboxWidget("Frustum Culling", &gFrustumCulling));
+    if (gGpuDrivenSupported)
+      pGuiWindow->AddWidget(CheckboxWidget("GPU Driven", &gGpuDriven));
+    pGuiWindow->AddWidget(
+        CheckboxWidget("Parallel Recording", &gParallelRecording));
+    pGuiWindow->AddWidget(DropdownWidget("Step Order", &gStepOrder,
+                                         gStepOrderNames, gStepOrderValues,
+                                         STEP_ORDER_COUNT));
+    IWidget *pPipelinedWidget = pGuiWindow->AddWidget(
+        CheckboxWidget("Pipelined Update", &gPipelinedUpdate));
+    pPipelinedWidget->pOnHover = showPipelinedUpdateTooltip;
+    pGuiWindow->AddWidget(CheckboxWidget("SIMD Update", &gSimdUpdate));
+    pGuiWindow->AddWidget(CheckboxWidget("Front To Back", &gFrontToBack));
+    pGuiWindow->AddWidget(CheckboxWidget("Impostors", &gImpostors));
+    pGuiWindow->AddWidget(SliderFloatWidget(
+        "Impostor Distance", &gImpostorDistance, 10.0f, 1000.0f, 10.0f, "%.0f"));
+    pGuiWindow->AddWidget(SliderUintWidget("Update Grain Size",
+                                           &gUpdateGrainSize, 64, 8192, 64));
+    IWidget *pVerifyWidget =
+        pGuiWindow->AddWidget(ButtonWidget("Verify SIMD Update"));
+    pVerifyWidget->pOnEdited = verifySphereKernels;
+    IWidget *pPickWidget = pGuiWindow->AddWidget(ButtonWidget("Pick Sphere"));
+    pPickWidget->pOnEdited = pickSphere;
+    pGuiWindow->AddWidget(PlotLinesWidget(
+        "Frame Time", gFrameTimeHistory, gFrameTimeHistoryLength,
+        &gFrameTimePlotMin, &gFrameTimePlotMax, &gFrameTimePlotSize,
+        "Frame time (ms)"));
+    pGuiWindow->AddWidget(HistogramWidget(
+        "Frame Time Histogram", gFrameTimeBuckets, gFrameTimeBucketCount,
+        &gFrameTimeBucketMin, &gFrameTimeBucketMax, gFrameTimePlotSize,
+        "Frames per 1 ms bucket"));
+
+    // App Actions
+    InputActionDesc actionDesc = {InputBindings::BUTTON_DUMP,
+                                  [](InputActionContext *ctx) {
+                                    dumpProfileData(
+                                        ((Renderer *)ctx->pUserData),
+                                        ((Renderer *)ctx->pUserData)->pName);
+                                    return true;
+                                  },
+                                  pRenderer};
+    addInputAction(&actionDesc);
+    actionDesc = {InputBindings::BUTTON_FULLSCREEN,
+                  [](InputActionContext *ctx) {
+                    toggleFullscreen(((IApp *)ctx->pUserData)->pWindow);
+                    return true;
+                  },
+                  this};
+    addInputAction(&actionDesc);
+    actionDesc = {InputBindings::BUTTON_EXIT, [](InputActionContext *ctx) {
+                    requestShutdown();
+                    return true;
+                  }};
+    addInputAction(&actionDesc);
+    actionDesc = {InputBindings::BUTTON_ANY,
+                  [](InputActionContext *ctx) {
+                    bool capture = gAppUI.OnButton(ctx->mBinding, ctx->mBool,
+                                                   ctx->pPosition);
+                    setEnableCaptureInput(
+                        capture && INPUT_ACTION_PHASE_CANCELED != ctx->mPhase);
+                    return true;
+                  },
+                  this};
+    addInputAction(&actionDesc);
+    endStartupStage(STARTUP_STAGE_UI);
+
+    waitForAllResourceLoads();
+
+    // Need to free memory;
+    tf_free(pSphereVertices);
+    tf_free(pSphereIndices);
+    endStartupStage(STARTUP_STAGE_RESOURCE_LOADS);
+
+    const int64_t spawnWaitStart = getUSec();
+    waitParallelFor(&gInitialSphereJob);
+    gStartupMs[STARTUP_STAGE_SPHERE_SPAWN_WAIT] =
+        usecToMs(getUSec() - spawnWaitStart);
+    setSphereState(gInitialSpawn.mState, gRequestedSphereCount);
+    gInitialSpawn.mState = {};
+    resizeSphereBuffers(gSphereCount);
+    LOGF(LogLevel::eINFO, "Sphere count set to %u", gSphereCount);
+    endStartupStage(STARTUP_STAGE_SPHERES);
+
+    // point light parameters
+    gFrameUniformData.mLightPosition = vec4(0, 0, 0, 1);
+    gFrameUniformData.mLightColor = vec4(0.9f, 0.9f, 0.7f, 1); // Pale Yellow
+
+    gStartupMs[STARTUP_STAGE_TOTAL] = usecToMs(getUSec() - startupStart);
+    logStartupTimes();
+
+    return true;
+  }
+
+  virtual void Exit() {
+    waitQueueIdle(pGraphicsQueue);
+    finishSphereStep();
+
+    exitInputSystem();
+
+    destroyCameraController(pCameraController);
+
+    gAppUI.Exit();
+
+    // Exit profile
+    exitProfiler();
+
+    for (uint32_t i = 0; i < gImageCount; ++i) {
+      removeResource(pFrameUniformBuffer[i]);
+      removeResource(pUpdateUniformBuffer[i]);
+      removeResource(pDrawArgsBuffer[i]);
+    }
+    removeResource(pDrawArgsResetBuffer);
+    removeResource(pTimestampReadbackBuffer);
+    removeQueryPool(pRenderer, pTimestampPool);
+    if (benchmarkEnabled()) {
+      for (uint32_t i = 0; i < gImageCount; ++i) {
+        removeResource(pDrawStatsReadbackBuffers[i]);
+        removeQueryPool(pRenderer, pDrawStatsPools[i]);
+      }
+      for (uint32_t s = 0; s < BENCHMARK_STAGE_COUNT; ++s)
+        tf_free(gBenchmarkSamples[s]);
+      tf_free(gOverdrawSamples);
+    }
+    removeInstanceBuffers();
+    removeGpuSphereBuffer();
+    removeDescriptorSet(pRenderer, pDescriptorSetUniforms);
+    removeDescriptorSet(pRenderer, pDescriptorSetGpuDriven);
+    removeDescriptorSet(pRenderer, pDescriptorSetUpdate);
+
+    removeResource(pVertexBuffer);
+    removeResource(pIndexBuffer);
+
+    removeIndirectCommandSignature(pRenderer, pDrawCommandSignature);
+
+    removePipeline(pRenderer, pPipeline);
+    pPipeline = nullptr;
+    removePipeline(pRenderer, pImpostorPipeline);
+    pImpostorPipeline = nullptr;
+    removePipeline(pRenderer, pUpdatePipeline);
+    saveSpherePipelineCache();
+    removePipelineCache(pRenderer, pPipelineCache);
+
+    removeShader(pRenderer, pShader);
+    removeShader(pRenderer, pImpostorShader);
+    removeShader(pRenderer, pUpdateShader);
+
+    removeRootSignature(pRenderer, pRootSignature);
+    removeRootSignature(pRenderer, pUpdateRootSignature);
+
+    freeSphereState(gSpheres);
+    gSpheres = {};
+    freeSphereState(gNextSpheres);
+    gNextSpheres = {};
+    tf_free(gRespawnLog.pSpheres);
+    tf_free(gRespawnLog.pBlockCount);
+    gRespawnLog = {};
+    tf_free(gSphereLod);
+    gSphereLod = nullptr;
+    tf_free(gBlockLodCount);
+    gBlockLodCount = nullptr;
+    tf_free(gBlockLodOffset);
+    gBlockLodOffset = nullptr;
+    tf_free(gSphereDepth);
+    gSphereDepth = nullptr;
+    tf_free(gSortKeys);
+    gSortKeys = nullptr;
+    tf_free(gSortSpheres);
+    gSortSpheres = nullptr;
+    freeRadixSortScratch(gSortScratch);
+    gSortScratch = {};
+    gSphereCount = 0;
+
+    for (uint32_t i = 0; i < gImageCount; ++i) {
+      removeFence(pRenderer, pRenderCompleteFences[i]);
+      removeSemaphore(pRenderer, pRenderCompleteSemaphores[i]);
+
+      for (uint32_t c = 0; c < gMaxDrawCmdCount; ++c) {
+        removeCmd(pRenderer, pDrawCmds[i][c]);
+        removeCmdPool(pRenderer, pDrawCmdPools[i][c]);
+      }
+      removeCmd(pRenderer, pUiCmds[i]);
+      removeCmd(pRenderer, pCmds[i]);
+      removeCmdPool(pRenderer, pCmdPools[i]);
+    }
+    removeSemaphore(pRenderer, pImageAcquiredSemaphore);
+
+    exitResourceLoaderInterface(pRenderer);
+    removeQueue(pRenderer, pGraphicsQueue);
+    removeRenderer(pRenderer);
+
+    shutdownThreadSystem(pThreadSystem);
+  }
+
+  bool addSwapChain() {
+    SwapChainDesc swapChainDesc = {};
+    swapChainDesc.mWindowHandle = pWindow->handle;
+    swapChainDesc.mPresentQueueCount = 1;
+    swapChainDesc.ppPresentQueues = &pGraphicsQueue;
+    swapChainDesc.mWidth = mSettings.mWidth;
+    swapChainDesc.mHeight = mSettings.mHeight;
+    swapChainDesc.mImageCount = gImageCount;
+    swapChainDesc.mColorFormat = getRecommendedSwapchainFormat(true);
+    swapChainDesc.mEnableVsync = mSettings.mDefaultVSyncEnabled;
+    ::addSwapChain(pRenderer, &swapChainDesc, &pSwapChain);
+
+    return pSwapChain != nullptr;
+  }
+
+  bool addOffscreenTarget() {
+    RenderTargetDesc colorRT = {};
+    colorRT.mArraySize = 1;
+    colorRT.mDepth = 1;
+    colorRT.mFormat = TinyImageFormat_R8G8B8A8_UNORM;
+    // Same state as an idle swapchain image, so Draw() treats both alike.
+    colorRT.mStartState = RESOURCE_STATE_PRESENT;
+    colorRT.mHeight = mSettings.mHeight;
+    colorRT.mSampleCount = SAMPLE_COUNT_1;
+    colorRT.mSampleQuality = 0;
+    colorRT.mWidth = mSettings.mWidth;
+    addRenderTarget(pRenderer, &colorRT, &pOffscreenTarget);
+
+    return pOffscreenTarget != nullptr;
+  }
+
+  bool addDepthBuffer() {
+    // Add depth buffer
+    RenderTargetDesc depthRT = {};
+    depthRT.mArraySize = 1;
+    depthRT.mClearValue.depth = 0.0f;
+    depthRT.mClearValue.stencil = 0;
+    depthRT.mDepth = 1;
+    depthRT.mFormat = TinyImageFormat_D32_SFLOAT;
+    depthRT.mHeight = mSettings.mHeight;
+    depthRT.mSampleCount = SAMPLE_COUNT_1;
+    depthRT.mSampleQuality = 0;
+    depthRT.mWidth = mSettings.mWidth;
+    depthRT.mFlags = TEXTURE_CREATION_FLAG_ON_TILE;
+    addRenderTarget(pRenderer, &depthRT, &pDepthBuffer);
+
+    return pDepthBuffer != nullptr;
+  }
+
+  virtual bool Load() override {
+    if (benchmarkEnabled() ? !addOffscreenTarget() : !addSwapChain())
+      return false;
+
+    if (!addDepthBuffer())
+      return false;
+
+    RenderTarget **ppColorTargets =
+        benchmarkEnabled() ? &pOffscreenTarget : pSwapChain->ppRenderTargets;
+    if (!gAppUI.Load(ppColorTargets, 1))
+      return false;
+
+    loadProfilerUI(&gAppUI, mSettings.mWidth, mSettings.mHeight);
+
+    // The pipelines outlive Unload, so a resize or fullscreen toggle that
+    // keeps the target formats reuses them.
+    const uint64_t formatHash =
+        hashPipelineFormats(ppColorTargets[0], pDepthBuffer);
+    if (pPipeline && formatHash == gPipelineFormatHash)
+      return true;
+    if (pPipeline) {
+      removePipeline(pRenderer, pPipeline);
+      removePipeline(pRenderer, pImpostorPipeline);
+    }
+    const int64_t pipelineStart = getUSec();
+
+    // layout and pipeline for sphere draw
+    VertexLayout vertexLayout = {};
+    vertexLayout.mAttribCount = 2;
+    vertexLayout.mAttribs[0].mSemantic = SEMANTIC_POSITION;
+    vertexLayout.mAttribs[0].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
+    vertexLayout.mAttribs[0].mBinding = 0;
+    vertexLayout.mAttribs[0].mLocation = 0;
+    vertexLayout.mAttribs[0].mOffset = 0;
+    vertexLayout.mAttribs[1].mSemantic = SEMANTIC_NORMAL;
+    vertexLayout.mAttribs[1].mFormat = TinyImageFormat_R32G32B32_SFLOAT;
+    vertexLayout.mAttribs[1].mBinding = 0;
+    vertexLayout.mAttribs[1].mLocation = 1;
+    vertexLayout.mAttribs[1].mOffset = 3 * sizeof(float);
+
+    RasterizerStateDesc rasterizerStateDesc = {};
+    rasterizerStateDesc.mCullMode = CULL_MODE_FRONT;
+
+    DepthStateDesc depthStateDesc = {};
+    depthStateDesc.mDepthTest = true;
+    depthStateDesc.mDepthWrite = true;
+    depthStateDesc.mDepthFunc = CMP_GEQUAL;
+
+    PipelineDesc desc = {};
+    desc.mType = PIPELINE_TYPE_GRAPHICS;
+    GraphicsPipelineDesc &pipelineSettings = desc.mGraphicsDesc;
+    pipelineSettings.mPrimitiveTopo = PRIMITIVE_TOPO_TRI_LIST;
+    pipelineSettings.mRenderTargetCount = 1;
+    pipelineSettings.pDepthState = &depthStateDesc;
+    pipelineSettings.pColorFormats = &ppColorTargets[0]->mFormat;
+    pipelineSettings.mSampleCount = ppColorTargets[0]->mSampleCount;
+    pipelineSettings.mSampleQuality = ppColorTargets[0]->mSampleQuality;
+    pipelineSettings.mDepthStencilFormat = pDepthBuffer->mFormat;
+    pipelineSettings.pRootSignature = pRootSignature;
+    pipelineSettings.pShaderProgram = pShader;
+    pipelineSettings.pVertexLayout = &vertexLayout;
+    pipelineSettings.pRasterizerState = &rasterizerStateDesc;
+    char pipelineName[48];
+    snprintf(pipelineName, sizeof(pipelineName), "sphere_draw_%016llx",
+             (unsigned long long)formatHash);
+    desc.pCache = pPipelineCache;
+    desc.pName = pipelineName;
+    addPipeline(pRenderer, &desc, &pPipeline);
+
+    // The impostor quads face the camera, so winding does not matter.
+    rasterizerStateDesc.mCullMode = CULL_MODE_NONE;
+    pipelineSettings.pShaderProgram = pImpostorShader;
+    snprintf(pipelineName, sizeof(pipelineName), "sphere_impostor_%016llx",
+             (unsigned long long)formatHash);
+    addPipeline(pRenderer, &desc, &pImpostorPipeline);
+
+    const float pipelineMs = usecToMs(getUSec() - pipelineStart);
+    // The first build is part of startup.
+    if (gPipelineFormatHash == 0)
+      gStartupMs[STARTUP_STAGE_PIPELINES] += pipelineMs;
+    gPipelineFormatHash = formatHash;
+    LOGF(LogLevel::eINFO, "Sphere pipelines built in %.2f ms, pipeline cache %s",
+         pipelineMs, gPipelineCacheLoaded ? "loaded" : "not loaded");
+    return true;
+  }
+  virtual void Unload() override {
+    waitQueueIdle(pGraphicsQueue);
+
+    unloadProfilerUI();
+    gAppUI.Unload();
+
+    if (benchmarkEnabled())
+      removeRenderTarget(pRenderer, pOffscreenTarget);
+    else
+      removeSwapChain(pRenderer, pSwapChain);
+    removeRenderTarget(pRenderer, pDepthBuffer);
+  }
+
+  virtual void Update(float deltaTime) override {
+    const int64_t frameStart = getUSec();
+    if (gLastUpdateStart != 0)
+      recordFrameTime(usecToMs(frameStart - gLastUpdateStart));
+    gLastUpdateStart = frameStart;
+    gFrameStats = {};
+
+    // Frame pacing: once the frame gMaxFramesInFlight back is done, sample
+    // input and start this one.
+    waitForFrame((gFrameIndex + gImageCount - gMaxFramesInFlight) %
+                 gImageCount);
+    gFrameStats.mPacingWaitMs = gFrameStats.mFenceWaitMs;
+    pollFrameCompletions();
+    collectCompletedGpuQueries();
+    if (gLateStart)
+      gFrameStats.mLateStartWaitMs = waitForLateStart();
+    gFrameInputTime[gFrameIndex] = getUSec();
+
+    if (benchmarkEnabled()) {
+      deltaTime = gBenchmarkDeltaTime;
+      gBenchmarkFrameStart = frameStart;
+    }
+
+    if (pSwapChain && pSwapChain->mEnableVsync != bToggleVSync) {
+      waitQueueIdle(pGraphicsQueue);
+      gFrameIndex = 0;
+      ::toggleVSync(pRenderer, &pSwapChain);
+    }
+
+    if (gSphereCountChanged) {
+      gSphereCountChanged = false;
+      waitQueueIdle(pGraphicsQueue);
+      setSphereCount(gRequestedSphereCount);
+    }
+
+    if (gGpuDriven != gGpuDrivenActive) {
+      waitQueueIdle(pGraphicsQueue);
+      finishSphereStep();
+      if (gGpuDrivenActive)
+        readBackGpuSpheres();
+      gGpuDrivenActive = gGpuDriven;
+      removeGpuSphereBuffer();
+      if (gGpuDrivenActive)
+        addGpuSphereBuffer();
+    }
+
+    updateInputSystem(mSettings.mWidth, mSettings.mHeight);
+
+    pCameraController->update(deltaTime);
+
+    const float aspectInverse =
+        (float)mSettings.mHeight / (float)mSettings.mWidth;
+    mat4 projMat =
+        mat4::perspective(gHorizontalFov, aspectInverse, 1000.0f, 0.3f);
+    gFrameUniformData.mProjectView =
+        projMat * pCameraController->getViewMatrix();
+    const vec3 cameraPosition = pCameraController->getViewPosition();
+    gFrameUniformData.mInstanceOrigin = vec4(cameraPosition, 1.0f);
+    const Frustum frustum = extractFrustum(gFrameUniformData.mProjectView);
+    const LodSelection lodSelection =
+        makeLodSelection(gFrameUniformData.mProjectView,
+                         projMat.getCol(1).getY() * 0.5f * mSettings.mHeight,
+                         gImpostors ? gImpostorDistance : FLT_MAX);
+
+    /************************************************************************/
+    // Scene Update
+    /************************************************************************/
+    // update camera with time
+
+    PROFILER_SET_CPU_SCOPE("Spheres", "Update position", 0xFFE8E8);
+    const int64_t updateStart = getUSec();
+    if (gGpuDrivenActive) {
+      // The update compute pass recorded in Draw does the work.
+      gUpdateUniformData.mFrustum = frustum;
+      gUpdateUniformData.mLodSelection = lodSelection;
+      gUpdateUniformData.mDeltaZ = deltaTime * speed;
+      gUpdateUniformData.mRadius = gSphereRadius;
+      gUpdateUniformData.mSpawnRadius = gSpawnRadius;
+      gUpdateUniformData.mSpawnDistance = gSpawnDistance;
+      gUpdateUniformData.mSeed = gRandomSeed;
+      gUpdateUniformData.mFrame = gSimFrame++;
+      gUpdateUniformData.mSphereCount = gSphereCount;
+      gUpdateUniformData.mCullEnabled = gFrustumCulling ? 1 : 0;
+      gUpdateUniformData.mInstanceOrigin = gFrameUniformData.mInstanceOrigin;
+    } else {
+      // Chunks must start on a block so each block is culled by one thread.
+      const uint32_t grainSize =
+          (gUpdateGrainSize + gSphereBlockSize - 1) & ~(gSphereBlockSize - 1);
+      const float dz = deltaTime * speed;
+
+      // When pipelined, this frame's state was normally stepped while the
+      // last frame was drawn, so only culling and the upload are left here.
+      if (gPipelinedUpdate && !gSphereStepPending)
+        beginSphereStep(dz, grainSize, gMaxParallelForThreads);
+      // A step started last frame is this frame's step even if pipelining
+      // has been turned off since, so the state is not advanced again.
+      const bool stepped = finishSphereStep();
+
+      SphereFrame frame = {gSpheres,        gSphereLod,
+                           gBlockLodCount,  gBlockLodOffset,
+                           nullptr,         dz,
+                           gRandomSeed,     gSimFrame,
+                           gSimdUpdate,     gFrustumCulling,
+                           frustum,         lodSelection,
+                           float3(cameraPosition.getX(), cameraPosition.getY(),
+                                  cameraPosition.getZ()),
+                           &gRespawnLog};
+      if (gFrontToBack) {
+        frame.pSphereDepth = gSphereDepth;
+        frame.pSortKeys = gSortKeys;
+        frame.pSortSpheres = gSortSpheres;
+      }
+      if (stepped) {
+        parallelFor(pThreadSystem, cullSphereFrameRange, &frame, gSphereCount,
+                    grainSize);
+      } else {
+        ++gSimFrame;
+        parallelFor(pThreadSystem, updateSphereFrameRange, &frame,
+                    gSphereCount, grainSize);
+        gFrameStats.mRespawns += sphereRespawnCount(gRespawnLog, gSphereCount);
+      }
+      gVisibleSphereCount =
+          countVisibleSpheres(gBlockLodCount, gSphereCount, gLodVisibleCount,
+                              gLodInstanceOffset, gBlockLodOffset);
+      // Sorting needs nothing from the GPU, so it is done before the wait.
+      if (gFrontToBack) {
+        parallelFor(pThreadSystem, writeSphereSortKeyRange, &frame,
+                    gSphereCount, grainSize);
+        sortVisibleSpheres(pThreadSystem, frame, gLodVisibleCount,
+                           gLodInstanceOffset, gSortScratch);
+      }
+
+      // The workers write the visible spheres straight into this frame's
+      // persistently mapped instance buffer, one contiguous range per LOD,
+      // once the GPU is done with it.
+      waitForFrame(gFrameIndex);
+      frame.pInstances =
+          (SphereInstance *)pInstanceBuffer[gFrameIndex]->pCpuMappedAddress;
+      if (gFrontToBack) {
+        parallelFor(pThreadSystem, writeSortedSphereFrameRange, &frame,
+                    gVisibleSphereCount, grainSize);
+      } else {
+        parallelFor(pThreadSystem, writeSphereFrameRange, &frame, gSphereCount,
+                    grainSize);
+      }
+      gFrameStats.mUploadBytes += gVisibleSphereCount * sizeof(SphereInstance);
+
+      if (gPipelinedUpdate) {
+        // Draw records while this step runs, see StepOrder.
+        uint32_t stepThreads = gMaxParallelForThreads;
+        if (gStepOrder == STEP_ORDER_SPLIT && parallelRecordingEnabled()) {
+          stepThreads = (getThreadSystemThreadCount(pThreadSystem) + 1) / 2;
+          if (stepThreads < 1)
+            stepThreads = 1;
+        }
+        beginSphereStep(dz, grainSize, stepThreads);
+      }
+    }
+    if (benchmarkEnabled()) {
+      addBenchmarkSample(BENCHMARK_STAGE_CPU_UPDATE, gBenchmarkFrame,
+                         usecToMs(getUSec() - updateStart));
+    }
+    gAppUI.Update(deltaTime);
+  }
+
+  virtual void Draw() override {
+    uint32_t swapchainImageIndex = 0;
+    RenderTarget *pRenderTarget = pOffscreenTarget;
+    if (!benchmarkEnabled()) {
+      PROFILER_SET_CPU_SCOPE("Frame", "Acquire image", 0xFFE8E8);
+      const int64_t acquireStart = getUSec();
+      acquireNextImage(pRenderer, pSwapChain, pImageAcquiredSemaphore, nullptr,
+                       &swapchainImageIndex);
+      gFrameStats.mAcquireWaitMs = usecToMs(getUSec() - acquireStart);
+      pRenderTarget = pSwapChain->ppRenderTargets[swapchainImageIndex];
+    }
+    Semaphore *pRenderCompleteSemaphore =
+        pRenderCompleteSemaphores[gFrameIndex];
+    Fence *pRenderCompleteFence = pRenderCompleteFences[gFrameIndex];
+
+    waitForFrame(gFrameIndex);
+    collectGpuQueries(gFrameIndex);
+
+    // Update uniform buffers
+    const int64_t uploadStart = getUSec();
+    BufferUpdateDesc frameCbv = {pFrameUniformBuffer[gFrameIndex]};
+    beginUpdateResource(&frameCbv);
+    *(FrameUniformBlock *)frameCbv.pMappedData = gFrameUniformData;
+    endUpdateResource(&frameCbv, nullptr);
+    gFrameStats.mUploadBytes += sizeof(FrameUniformBlock);
+
+    if (gGpuDrivenActive) {
+      BufferUpdateDesc updateCbv = {pUpdateUniformBuffer[gFrameIndex]};
+      beginUpdateResource(&updateCbv);
+      *(UpdateUniformBlock *)updateCbv.pMappedData = gUpdateUniformData;
+      endUpdateResource(&updateCbv, nullptr);
+      gFrameStats.mUploadBytes += sizeof(UpdateUniformBlock);
+    }
+    const int64_t recordStart = getUSec();
+    // Reset cmd pool for this frame
+    resetCmdPool(pRenderer, pCmdPools[gFrameIndex]);
+
+    Cmd *cmd = pCmds[gFrameIndex];
+    beginCmd(cmd);
+
+    cmdBeginGpuFrameProfile(cmd, gGpuProfileToken);
+
+    cmdResetQueryPool(cmd, pTimestampPool, gFrameIndex * GPU_TIMESTAMP_COUNT,
+                      GPU_TIMESTAMP_COUNT);
+    if (benchmarkEnabled()) {
+      cmdResetQueryPool(cmd, pDrawStatsPools[gFrameIndex], 0,
+                        gMaxDrawCmdCount);
+    }
+    writeGpuTimestamp(cmd, gFrameIndex, GPU_TIMESTAMP_FRAME_BEGIN);
+
+    if (gGpuDrivenActive) {
+      cmdBeginGpuTimestampQuery(cmd, gGpuProfileToken, "Update Spheres");
+      Buffer *pDrawArgs = pDrawArgsBuffer[gFrameIndex];
+      Buffer *pVisible = pVisibleInstanceBuffer[gFrameIndex];
+
+      BufferBarrier bufferBarriers[3] = {
+          {pDrawArgs, RESOURCE_STATE_INDIRECT_ARGUMENT,
+           RESOURCE_STATE_COPY_DEST},
+      };
+      cmdResourceBarrier(cmd, 1, bufferBarriers, 0, nullptr, 0, nullptr);
+      cmdUpdateBuffer(cmd, pDrawArgs, 0, pDrawArgsResetBuffer, 0,
+                      sizeof(IndirectDrawIndexArguments) * gSphereLodCount);
+
+      // The UAV to UAV barrier orders this pass after last frame's.
+      bufferBarriers[0] = {pDrawArgs, RESOURCE_STATE_COPY_DEST,
+                           RESOURCE_STATE_UNORDERED_ACCESS};
+      bufferBarriers[1] = {pVisible, RESOURCE_STATE_SHADER_RESOURCE,
+                           RESOURCE_STATE_UNORDERED_ACCESS};
+      bufferBarriers[2] = {pGpuSphereBuffer, RESOURCE_STATE_UNORDERED_ACCESS,
+                           RESOURCE_STATE_UNORDERED_ACCESS};
+      cmdResourceBarrier(cmd, 3, bufferBarriers, 0, nullptr, 0, nullptr);
+
+      cmdBindPipeline(cmd, pUpdatePipeline);
+      cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetUpdate);
+      ++gFrameStats.mDescriptorBinds;
+      cmdDispatch(cmd,
+                  (gSphereCount + gUpdateThreadCount - 1) / gUpdateThreadCount,
+                  1, 1);
+
+      bufferBarriers[0] = {pDrawArgs, RESOURCE_STATE_UNORDERED_ACCESS,
+                           RESOURCE_STATE_INDIRECT_ARGUMENT};
+      bufferBarriers[1] = {pVisible, RESOURCE_STATE_UNORDERED_ACCESS,
+                           RESOURCE_STATE_SHADER_RESOURCE};
+      cmdResourceBarrier(cmd, 2, bufferBarriers, 0, nullptr, 0, nullptr);
+      cmdEndGpuTimestampQuery(cmd, gGpuProfileToken);
+    }
+    writeGpuTimestamp(cmd, gFrameIndex, GPU_TIMESTAMP_UPDATE_END);
+
+    RenderTargetBarrier barriers[] = {
+        {pRenderTarget, RESOURCE_STATE_PRESENT, RESOURCE_STATE_RENDER_TARGET},
+    };
+    cmdResourceBarrier(cmd, 0, nullptr, 0, nullptr, 1, barriers);
+
+    // simply record the screen cleaning command
+    LoadActionsDesc loadActions = {};
+    loadActions.mLoadActionsColor[0] = LOAD_ACTION_CLEAR;
+    loadActions.mLoadActionDepth = LOAD_ACTION_CLEAR;
+    loadActions.mClearDepth.depth = 0.0f;
+    loadActions.mClearDepth.stencil = 0;
+    cmdBindRenderTargets(cmd, 1, &pRenderTarget, pDepthBuffer, &loadActions,
+                         nullptr, nullptr, -1, -1);
+
+    cmdSetViewport(cmd, 0.0f, 0.0f, (float)pRenderTarget->mWidth,
+                   (float)pRenderTarget->mHeight, 0.0f, 1.0f);
+    cmdSetScissor(cmd, 0, 0, pRenderTarget->mWidth, pRenderTarget->mHeight);
+
+    // Cmds submitted this frame, in order.
+    Cmd *submitCmds[gMaxDrawCmdCount + 2];
+    uint32_t submitCmdCount = 0;
+
+    ////// draw planets
+    cmdBeginGpuTimestampQuery(cmd, gGpuProfileToken, "Draw Spheres");
+    if (parallelRecordingEnabled()) {
+      // This cmd ends after the clear. The draws go into their own cmds,
+      // recorded on the workers, and the rest of the frame into pUiCmds.
+      cmdBindRenderTargets(cmd, 0, nullptr, nullptr, nullptr, nullptr, nullptr,
+                           -1, -1);
+      endCmd(cmd);
+      submitCmds[submitCmdCount++] = cmd;
+      const uint32_t drawCmdCount =
+          recordSphereDrawsParallel(pRenderTarget, submitCmds + submitCmdCount);
+      submitCmdCount += drawCmdCount;
+      gDrawStatsCount[gFrameIndex] = drawCmdCount;
+      // One descriptor set bind per draw cmd.
+      gFrameStats.mDrawCalls += gVisibleSphereCount;
+      gFrameStats.mDescriptorBinds += drawCmdCount;
+
+      cmd = pUiCmds[gFrameIndex];
+      beginCmd(cmd);
+    } else {
+      beginDrawStats(cmd, 0);
+      gDrawStatsCount[gFrameIndex] = 1;
+      bindSpherePipeline(cmd);
+      if (gGpuDrivenActive) {
+        // The visible counts are only known on the GPU, so this is always one
+        // instanced draw per LOD.
+        cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetGpuDriven);
+        ++gFrameStats.mDescriptorBinds;
+        const uint32_t lodCount =
+            gImpostors ? gSphereLodCount : gSphereMeshLodCount;
+        gFrameStats.mDrawCalls += lodCount;
+        for (uint32_t l = 0; l < lodCount; ++l) {
+          if (l == gSphereImpostorLod)
+            cmdBindPipeline(cmd, pImpostorPipeline);
+          const uint32_t instanceOffset = l * gSphereCount;
+          cmdBindPushConstants(cmd, pRootSignature, "sphereRootConstant",
+                               &instanceOffset);
+          cmdExecuteIndirect(cmd, pDrawCommandSignature, 1,
+                             pDrawArgsBuffer[gFrameIndex],
+                             l * sizeof(IndirectDrawIndexArguments), nullptr,
+                             0);
+        }
+      } else if (gRenderMode == RENDER_MODE_INSTANCED) {
+        cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetUniforms);
+        ++gFrameStats.mDescriptorBinds;
+        for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+          if (gLodVisibleCount[l] == 0)
+            continue;
+          if (l == gSphereImpostorLod)
+            cmdBindPipeline(cmd, pImpostorPipeline);
+          ++gFrameStats.mDrawCalls;
+          const SphereLod &lod = gSphereLods[l];
+          cmdBindPushConstants(cmd, pRootSignature, "sphereRootConstant",
+                               &gLodInstanceOffset[l]);
+          cmdDrawIndexedInstanced(cmd, lod.mIndexCount, lod.mFirstIndex,
+                                  gLodVisibleCount[l], lod.mVertexOffset, 0);
+        }
+      } else {
+        cmdBindDescriptorSet(cmd, gFrameIndex, pDescriptorSetUniforms);
+        recordSphereDraws(cmd, 0, gVisibleSphereCount);
+        ++gFrameStats.mDescriptorBinds;
+        gFrameStats.mDrawCalls += gVisibleSphereCount;
+      }
+      endDrawStats(cmd, 0);
+    }
+    cmdEndGpuTimestampQuery(cmd, gGpuProfileToken);
+    writeGpuTimestamp(cmd, gFrameIndex, GPU_TIMESTAMP_DRAW_END);
+
+    loadActions = {};
+    loadActions.mLoadActionsColor[0] = LOAD_ACTION_LOAD;
+    cmdBindRenderTargets(cmd, 1, &pRenderTarget, nullptr, &loadActions, nullptr,
+                         nullptr, -1, -1);
+    cmdBeginGpuTimestampQuery(cmd, gGpuProfileToken, "Draw UI");
+    {
+      const float txtIndent = 8.f;
+      float2 txtSizePx =
+          cmdDrawCpuProfile(cmd, float2(txtIndent, 15.f), &gFrameTimeDraw);
+      float2 gpuTxtSizePx =
+          cmdDrawGpuProfile(cmd, float2(txtIndent, txtSizePx.y + 30.f),
+                            gGpuProfileToken, &gFrameTimeDraw);
+
+      char sphereText[128];
+      if (gGpuDrivenActive)
+        snprintf(sphereText, sizeof(sphereText),
+                 "Spheres: %u, updated and culled on the GPU", gSphereCount);
+      else
+        snprintf(sphereText, sizeof(sphereText),
+                 "Spheres: %u visible (LOD %u / %u / %u, %u impostors), %u "
+                 "culled",
+                 gVisibleSphereCount, gLodVisibleCount[0],
+                 gLodVisibleCount[1], gLodVisibleCount[2],
+                 gLodVisibleCount[gSphereImpostorLod],
+                 gSphereCount - gVisibleSphereCount);
+      gAppUI.DrawText(
+          cmd, float2(txtIndent, txtSizePx.y + gpuTxtSizePx.y + 45.f),
+          sphereText, &gFrameTimeDraw);
+
+      char statsText[192];
+      char respawnText[16] = "-";
+      if (!gGpuDrivenActive)
+        snprintf(respawnText, sizeof(respawnText), "%u",
+                 gFrameStats.mRespawns);
+      snprintf(statsText, sizeof(statsText),
+               "Respawns: %s, upload: %.1f KB, draws: %u, descriptor binds: "
+               "%u, fence wait: %.2f ms, acquire wait: %.2f ms",
+               respawnText, gFrameStats.mUploadBytes / 1024.0f,
+               gFrameStats.mDrawCalls, gFrameStats.mDescriptorBinds,
+               gFrameStats.mFenceWaitMs, gFrameStats.mAcquireWaitMs);
+      gAppUI.DrawText(
+          cmd, float2(txtIndent, txtSizePx.y + gpuTxtSizePx.y + 70.f),
+          statsText, &gFrameTimeDraw);
+
+      char pacingText[192];
+      snprintf(pacingText, sizeof(pacingText),
+               "Frames in flight: %u, input to GPU done: <= %.2f ms, pacing "
+               "wait: %.2f ms, late start wait: %.2f ms, GPU frame: %.2f ms",
+               gMaxFramesInFlight, averageFrameLatencyMs(),
+               gFrameStats.mPacingWaitMs, gFrameStats.mLateStartWaitMs,
+               gGpuFrameMs);
+      gAppUI.DrawText(
+          cmd, float2(txtIndent, txtSizePx.y + gpuTxtSizePx.y + 95.f),
+          pacingText, &gFrameTimeDraw);
+
+      if (pWidgetTooltip) {
+        gAppUI.DrawText(
+            cmd, float2(txtIndent, txtSizePx.y + gpuTxtSizePx.y + 120.f),
+            pWidgetTooltip, &gFrameTimeDraw);
+        pWidgetTooltip = nullptr;
+      }
+
+      cmdDrawProfilerUI();
+
+      gAppUI.Gui(pGuiWindow);
+      gAppUI.Draw(cmd);
+      cmdBindRenderTargets(cmd, 0, nullptr, nullptr, nullptr, nullptr, nullptr,
+                           -1, -1);
+      cmdEndGpuTimestampQuery(cmd, gGpuProfileToken);
+
+      barriers[0] = {pRenderTarget, RESOURCE_STATE_RENDER_TARGET,
+                     RESOURCE_STATE_PRESENT};
+      cmdResourceBarrier(cmd, 0, nullptr, 0, nullptr, 1, barriers);
+    }
+    writeGpuTimestamp(cmd, gFrameIndex, GPU_TIMESTAMP_FRAME_END);
+    cmdResolveQuery(cmd, pTimestampPool, pTimestampReadbackBuffer,
+                    gFrameIndex * GPU_TIMESTAMP_COUNT, GPU_TIMESTAMP_COUNT);
+    if (benchmarkEnabled() && gDrawStatsCount[gFrameIndex] > 0) {
+      cmdResolveQuery(cmd, pDrawStatsPools[gFrameIndex],
+                      pDrawStatsReadbackBuffers[gFrameIndex], 0,
+                      gDrawStatsCount[gFrameIndex]);
+    }
+    gTimestampFrame[gFrameIndex] = gBenchmarkFrame;
+    cmdEndGpuFrameProfile(cmd, gGpuProfileToken);
+    endCmd(cmd);
+    submitCmds[submitCmdCount++] = cmd;
+
+    QueueSubmitDesc submitDesc = {};
+    submitDesc.mCmdCount = submitCmdCount;
+    submitDesc.ppCmds = submitCmds;
+    submitDesc.pSignalFence = pRenderCompleteFence;
+    if (!benchmarkEnabled()) {
+      submitDesc.mSignalSemaphoreCount = 1;
+      submitDesc.mWaitSemaphoreCount = 1;
+      submitDesc.ppSignalSemaphores = &pRenderCompleteSemaphore;
+      submitDesc.ppWaitSemaphores = &pImageAcquiredSemaphore;
+    }
+    queueSubmit(pGraphicsQueue, &submitDesc);
+    gFrameInFlight[gFrameIndex] = true;
+    predictFrameDone(gFrameIndex);
+    if (!benchmarkEnabled()) {
+      QueuePresentDesc presentDesc = {};
+      presentDesc.mIndex = swapchainImageIndex;
+      presentDesc.mWaitSemaphoreCount = 1;
+      presentDesc.pSwapChain = pSwapChain;
+      presentDesc.ppWaitSemaphores = &pRenderCompleteSemaphore;
+      presentDesc.mSubmitDone = true;
+      queuePresent(pGraphicsQueue, &presentDesc);
+    }
+    flipProfiler();
+
+    if (benchmarkEnabled()) {
+      const int64_t frameEnd = getUSec();
+      addBenchmarkSample(BENCHMARK_STAGE_CPU_UPLOAD, gBenchmarkFrame,
+                         usecToMs(recordStart - uploadStart));
+      addBenchmarkSample(BENCHMARK_STAGE_CPU_RECORD, gBenchmarkFrame,
+                         usecToMs(frameEnd - recordStart));
+      addBenchmarkSample(BENCHMARK_STAGE_CPU_FRAME, gBenchmarkFrame,
+                         usecToMs(frameEnd - gBenchmarkFrameStart));
+
+      if (++gBenchmarkFrame == gBenchmarkWarmupFrames + gBenchmarkFrames) {
+        waitQueueIdle(pGraphicsQueue);
+        for (uint32_t i = 0; i < gImageCount; ++i)
+          collectGpuQueries(i);
+        writeBenchmarkResults(gBenchmarkOutput);
+        requestShutdown();
+      }
+    }
+
+    gFrameIndex = (gFrameIndex + 1) % gImageCount;
+  }
+
+  virtual const char *GetName() override { return "Sphere Test"; }
+};
+
+DEFINE_APPLICATION_MAIN(App)
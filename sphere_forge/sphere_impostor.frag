@@ -0,0 +1,60 @@
+// Ray traces the sphere of a sphere_impostor.vert quad: exact silhouette,
+// depth and per-pixel point light shading. SPHERE_RADIUS is defined by the
+// application.
+
+cbuffer frameBlock : register(b0, UPDATE_FREQ_PER_FRAME)
+{
+    float4x4 mvp;
+
+    // Point Light Information
+    float4 lightPosition;
+    float4 lightColor;
+
+    // World position the instance positions are relative to, the camera
+    float4 instanceOrigin;
+};
+
+struct VSOutput
+{
+    float4 Position : SV_POSITION;
+    float3 Ray : TEXCOORD0;
+    nointerpolation float3 Center : TEXCOORD1;
+    nointerpolation float4 Color : COLOR;
+};
+
+// Depth is reversed, and the sphere is never in front of its quad, so the
+// written depth never exceeds the quad's and early depth testing stays on.
+struct PSOutput
+{
+    float4 Color : SV_TARGET;
+    float Depth : SV_DepthLessEqual;
+};
+
+PSOutput main(VSOutput input)
+{
+    PSOutput output;
+    float3 dir = normalize(input.Ray);
+
+    // Nearest hit of the ray from the camera, measured from the point of the
+    // ray closest to the center to avoid cancellation at large distances.
+    float closest = dot(dir, input.Center);
+    float3 offset = input.Center - closest * dir;
+    float h = SPHERE_RADIUS * SPHERE_RADIUS - dot(offset, offset);
+    if (h < 0.0f)
+        discard;
+    float3 hit = dir * (closest - sqrt(h));
+    float3 normal = (hit - input.Center) / SPHERE_RADIUS;
+    float3 position = instanceOrigin.xyz + hit;
+
+    float4 clipPosition = mul(mvp, float4(position, 1.0f));
+    output.Depth = clipPosition.z / clipPosition.w;
+
+    // Same point light as basic.vert, per pixel
+    float ambientCoeff = 0.4;
+    float3 lightDir = normalize(lightPosition.xyz - position);
+    float3 baseColor = input.Color.xyz;
+    float3 diffuse = lightColor.xyz * baseColor * max(dot(normal, lightDir), 0.0);
+    float3 ambient = baseColor * ambientCoeff;
+    output.Color = float4(diffuse + ambient, 1.0);
+    return output;
+}
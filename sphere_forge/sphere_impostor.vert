@@ -0,0 +1,79 @@
+// Screen-space impostor for distant spheres. Each instance is a quad facing
+// the camera that covers the sphere's silhouette, and sphere_impostor.frag ray
+// traces the sphere inside it, so the cost per sphere is four vertices at any
+// distance. SPHERE_RADIUS is defined by the application.
+
+cbuffer frameBlock : register(b0, UPDATE_FREQ_PER_FRAME)
+{
+    float4x4 mvp;
+
+    // Point Light Information
+    float4 lightPosition;
+    float4 lightColor;
+
+    // World position the instance positions are relative to, the camera
+    float4 instanceOrigin;
+};
+
+// Matches SphereInstance in sphere_sim.h
+struct SphereInstance
+{
+    uint positionXY; // half x, half y
+    uint positionZ; // half z
+    uint color; // RGBA8
+};
+
+StructuredBuffer<SphereInstance> instanceBuffer : register(t0, UPDATE_FREQ_PER_FRAME);
+
+// First record of the draw, as in basic.vert
+cbuffer sphereRootConstant : register(b1, UPDATE_FREQ_PER_DRAW)
+{
+    uint instanceOffset;
+};
+
+struct VSInput
+{
+    float4 Position : POSITION; // quad corner in xy
+    float4 Normal : NORMAL;
+};
+
+struct VSOutput
+{
+    float4 Position : SV_POSITION;
+    // Camera to this point of the quad
+    float3 Ray : TEXCOORD0;
+    // Sphere center relative to the camera
+    nointerpolation float3 Center : TEXCOORD1;
+    nointerpolation float4 Color : COLOR;
+};
+
+float4 unpackColor(uint color)
+{
+    return float4(color & 0xff, (color >> 8) & 0xff, (color >> 16) & 0xff, color >> 24) / 255.0f;
+}
+
+VSOutput main(VSInput input, uint InstanceID : SV_InstanceID)
+{
+    VSOutput result;
+    SphereInstance instance = instanceBuffer[instanceOffset + InstanceID];
+    float3 center = f16tof32(uint3(instance.positionXY, instance.positionXY >> 16, instance.positionZ));
+
+    // The quad lies in the plane touching the near side of the sphere and is
+    // just large enough to hold the cone of rays that graze it. Every point of
+    // the sphere is behind the quad on its view ray, which the conservative
+    // depth output of the pixel shader relies on.
+    float distance = max(length(center), SPHERE_RADIUS * 1.01f);
+    float3 forward = center / distance;
+    float3 up = abs(forward.y) < 0.99f ? float3(0.0f, 1.0f, 0.0f) : float3(1.0f, 0.0f, 0.0f);
+    float3 right = normalize(cross(up, forward));
+    up = cross(forward, right);
+    float nearDistance = distance - SPHERE_RADIUS;
+    float halfSize = nearDistance * SPHERE_RADIUS / sqrt(distance * distance - SPHERE_RADIUS * SPHERE_RADIUS);
+    float3 corner = forward * nearDistance + (right * input.Position.x + up * input.Position.y) * halfSize;
+
+    result.Position = mul(mvp, float4(instanceOrigin.xyz + corner, 1.0f));
+    result.Ray = corner;
+    result.Center = center;
+    result.Color = unpackColor(instance.color);
+    return result;
+}
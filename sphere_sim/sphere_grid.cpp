@@ -0,0 +1,293 @@
+#include "sphere_grid.h"
+
+#include <cfloat>
+#include <cstring>
+
+#include <OS/Interfaces/IMemory.h>
+
+constexpr float gGridRingLength = gGridCellsZ * gGridCellSize;
+
+void initSphereGrid(SphereGrid &grid, const SphereState &state,
+                    uint32_t count) {
+  grid.pCells =
+      (SphereGridCell *)tf_calloc(gGridCellCount, sizeof(SphereGridCell));
+  grid.pSphereCell = (uint16_t *)tf_malloc(count * sizeof(uint16_t));
+  grid.mSphereCount = count;
+
+  // Count first so every list is allocated once, at its final size.
+  for (uint32_t i = 0; i < count; ++i) {
+    const uint32_t cell = sphereGridCell(state.pX[i], state.pY[i], state.pZ[i]);
+    grid.pSphereCell[i] = (uint16_t)cell;
+    ++grid.pCells[cell].mCapacity;
+  }
+  for (uint32_t c = 0; c < gGridCellCount; ++c) {
+    SphereGridCell &gridCell = grid.pCells[c];
+    if (gridCell.mCapacity > 0) {
+      gridCell.pSpheres =
+          (uint32_t *)tf_malloc(gridCell.mCapacity * sizeof(uint32_t));
+    }
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    SphereGridCell &gridCell = grid.pCells[grid.pSphereCell[i]];
+    gridCell.pSpheres[gridCell.mCount++] = i;
+  }
+}
+
+void exitSphereGrid(SphereGrid &grid) {
+  if (grid.pCells) {
+    for (uint32_t c = 0; c < gGridCellCount; ++c)
+      tf_free(grid.pCells[c].pSpheres);
+  }
+  tf_free(grid.pCells);
+  tf_free(grid.pSphereCell);
+  grid = {};
+}
+
+// Start of the one place on the ring where slice iz's z is live.
+static float sliceMinZ(uint32_t iz) {
+  float z = fmodf(iz * gGridCellSize - gGridMinZ, gGridRingLength);
+  if (z < 0.0f)
+    z += gGridRingLength;
+  return z + gGridMinZ;
+}
+
+// Bounds of cell (ix, iy) of the slice starting at z, margin included. For
+// ix = gGridCellsXY they are the bounds of row iy, and for ix = iy =
+// gGridCellsXY those of the whole slice.
+static void cellBounds(uint32_t ix, uint32_t iy, float z, float *pMin,
+                       float *pMax) {
+  const float halfWidth = 0.5f * gGridCellsXY * gGridCellSize;
+  pMin[0] = ix * gGridCellSize - halfWidth - gGridMargin;
+  pMin[1] = iy * gGridCellSize - halfWidth - gGridMargin;
+  pMin[2] = z - gGridMargin;
+  pMax[0] = pMin[0] + gGridCellSize + 2.0f * gGridMargin;
+  pMax[1] = pMin[1] + gGridCellSize + 2.0f * gGridMargin;
+  pMax[2] = pMin[2] + gGridCellSize + 2.0f * gGridMargin;
+  // The outer cells in x and y also hold every sphere clamped into them.
+  if (ix == 0 || ix == gGridCellsXY)
+    pMin[0] = -FLT_MAX;
+  if (ix >= gGridCellsXY - 1)
+    pMax[0] = FLT_MAX;
+  if (iy == 0 || iy == gGridCellsXY)
+    pMin[1] = -FLT_MAX;
+  if (iy >= gGridCellsXY - 1)
+    pMax[1] = FLT_MAX;
+}
+
+void sphereGridCellBounds(uint32_t cell, float *pMin, float *pMax) {
+  const uint32_t ix = cell % gGridCellsXY;
+  const uint32_t iy = cell / gGridCellsXY % gGridCellsXY;
+  const uint32_t iz = cell / (gGridCellsXY * gGridCellsXY);
+  cellBounds(ix, iy, sliceMinZ(iz), pMin, pMax);
+}
+
+enum CellVisibility {
+  CELL_OUTSIDE,
+  CELL_INSIDE,
+  CELL_PARTIAL,
+};
+
+static CellVisibility classifyCell(const Frustum &frustum, const float *pMin,
+                                   const float *pMax, float radius) {
+  CellVisibility visibility = CELL_INSIDE;
+  for (uint32_t p = 0; p < 6; ++p) {
+    const float *plane = frustum.mPlanes[p];
+    // Box corners nearest and farthest along the plane normal.
+    float nearest = plane[3];
+    float farthest = plane[3];
+    for (uint32_t a = 0; a < 3; ++a) {
+      const float lo = plane[a] * pMin[a];
+      const float hi = plane[a] * pMax[a];
+      nearest += lo < hi ? lo : hi;
+      farthest += lo < hi ? hi : lo;
+    }
+    if (farthest < -radius)
+      return CELL_OUTSIDE;
+    if (nearest < -radius)
+      visibility = CELL_PARTIAL;
+  }
+  return visibility;
+}
+
+static uint32_t gatherCell(const SphereGridCell &gridCell,
+                           CellVisibility visibility,
+                           const SphereState &state, const Frustum &frustum,
+                           float radius, uint32_t *pVisible) {
+  if (visibility == CELL_INSIDE) {
+    memcpy(pVisible, gridCell.pSpheres, gridCell.mCount * sizeof(uint32_t));
+    return gridCell.mCount;
+  }
+  uint32_t visibleCount = 0;
+  for (uint32_t s = 0; s < gridCell.mCount; ++s) {
+    const uint32_t i = gridCell.pSpheres[s];
+    if (sphereInFrustum(frustum, state.pX[i], state.pY[i], state.pZ[i],
+                        radius))
+      pVisible[visibleCount++] = i;
+  }
+  return visibleCount;
+}
+
+uint32_t queryGridFrustum(const SphereGrid &grid, const SphereState &state,
+                          const Frustum &frustum, float radius,
+                          uint32_t *pVisible) {
+  uint32_t visibleCount = 0;
+  float cellMin[3], cellMax[3];
+  for (uint32_t iz = 0; iz < gGridCellsZ; ++iz) {
+    const float z = sliceMinZ(iz);
+    cellBounds(gGridCellsXY, gGridCellsXY, z, cellMin, cellMax);
+    const CellVisibility sliceVisibility =
+        classifyCell(frustum, cellMin, cellMax, radius);
+    if (sliceVisibility == CELL_OUTSIDE)
+      continue;
+
+    const SphereGridCell *pSlice =
+        grid.pCells + iz * gGridCellsXY * gGridCellsXY;
+    for (uint32_t iy = 0; iy < gGridCellsXY; ++iy) {
+      // Rows of a partly visible slice are classified before their cells.
+      CellVisibility rowVisibility = sliceVisibility;
+      if (rowVisibility == CELL_PARTIAL) {
+        cellBounds(gGridCellsXY, iy, z, cellMin, cellMax);
+        rowVisibility = classifyCell(frustum, cellMin, cellMax, radius);
+        if (rowVisibility == CELL_OUTSIDE)
+          continue;
+      }
+
+      const SphereGridCell *pRow = pSlice + iy * gGridCellsXY;
+      for (uint32_t ix = 0; ix < gGridCellsXY; ++ix) {
+        const SphereGridCell &gridCell = pRow[ix];
+        if (gridCell.mCount == 0)
+          continue;
+        CellVisibility visibility = rowVisibility;
+        if (visibility == CELL_PARTIAL) {
+          cellBounds(ix, iy, z, cellMin, cellMax);
+          visibility = classifyCell(frustum, cellMin, cellMax, radius);
+          if (visibility == CELL_OUTSIDE)
+            continue;
+        }
+        visibleCount += gatherCell(gridCell, visibility, state, frustum,
+                                   radius, pVisible + visibleCount);
+      }
+    }
+  }
+  return visibleCount;
+}
+
+// Entry distance of the ray into the box, or FLT_MAX if it misses within
+// [0, maxT].
+static float rayBoxEntry(const float3 &origin, const float3 &invDir,
+                         const float *pMin, const float *pMax, float maxT) {
+  const float o[3] = {origin.x, origin.y, origin.z};
+  const float inv[3] = {invDir.x, invDir.y, invDir.z};
+  float tEnter = 0.0f;
+  float tExit = maxT;
+  for (uint32_t a = 0; a < 3; ++a) {
+    float t0 = (pMin[a] - o[a]) * inv[a];
+    float t1 = (pMax[a] - o[a]) * inv[a];
+    if (t0 > t1) {
+      const float t = t0;
+      t0 = t1;
+      t1 = t;
+    }
+    // A ray parallel to the slab gives NaN for a bound it lies on; those
+    // comparisons are false, which keeps the ray inside.
+    if (t0 > tEnter)
+      tEnter = t0;
+    if (t1 < tExit)
+      tExit = t1;
+  }
+  return tEnter <= tExit ? tEnter : FLT_MAX;
+}
+
+// First hit distance of the ray with the sphere, or FLT_MAX.
+static float raySphere(const float3 &origin, const float3 &dir, float x,
+                       float y, float z, float radius) {
+  const float ox = origin.x - x;
+  const float oy = origin.y - y;
+  const float oz = origin.z - z;
+  const float b = ox * dir.x + oy * dir.y + oz * dir.z;
+  const float c = ox * ox + oy * oy + oz * oz - radius * radius;
+  const float discriminant = b * b - c;
+  if (discriminant < 0.0f)
+    return FLT_MAX;
+  const float root = sqrtf(discriminant);
+  const float t = -b - root;
+  if (t >= 0.0f)
+    return t;
+  // Origin inside the sphere.
+  return -b + root >= 0.0f ? 0.0f : FLT_MAX;
+}
+
+bool queryGridRay(const SphereGrid &grid, const SphereState &state,
+                  const float3 &origin, const float3 &dir, float maxT,
+                  float radius, uint32_t *pSphere, float *pT) {
+  const float3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+  float best = maxT;
+  bool hit = false;
+  float cellMin[3], cellMax[3];
+  auto inflate = [&cellMin, &cellMax, radius]() {
+    for (uint32_t a = 0; a < 3; ++a) {
+      cellMin[a] -= radius;
+      cellMax[a] += radius;
+    }
+  };
+  for (uint32_t iz = 0; iz < gGridCellsZ; ++iz) {
+    const float z = sliceMinZ(iz);
+    cellBounds(gGridCellsXY, gGridCellsXY, z, cellMin, cellMax);
+    inflate();
+    if (rayBoxEntry(origin, invDir, cellMin, cellMax, best) == FLT_MAX)
+      continue;
+
+    const SphereGridCell *pSlice =
+        grid.pCells + iz * gGridCellsXY * gGridCellsXY;
+    for (uint32_t iy = 0; iy < gGridCellsXY; ++iy) {
+      cellBounds(gGridCellsXY, iy, z, cellMin, cellMax);
+      inflate();
+      if (rayBoxEntry(origin, invDir, cellMin, cellMax, best) == FLT_MAX)
+        continue;
+
+      const SphereGridCell *pRow = pSlice + iy * gGridCellsXY;
+      for (uint32_t ix = 0; ix < gGridCellsXY; ++ix) {
+        const SphereGridCell &gridCell = pRow[ix];
+        if (gridCell.mCount == 0)
+          continue;
+        cellBounds(ix, iy, z, cellMin, cellMax);
+        inflate();
+        if (rayBoxEntry(origin, invDir, cellMin, cellMax, best) == FLT_MAX)
+          continue;
+
+        for (uint32_t s = 0; s < gridCell.mCount; ++s) {
+          const uint32_t i = gridCell.pSpheres[s];
+          const float t = raySphere(origin, dir, state.pX[i], state.pY[i],
+                                    state.pZ[i], radius);
+          if (t < best) {
+            best = t;
+            *pSphere = i;
+            hit = true;
+          }
+        }
+      }
+    }
+  }
+  if (hit)
+    *pT = best;
+  return hit;
+}
+
+bool raycastSpheres(const SphereState &state, uint32_t count,
+                    const float3 &origin, const float3 &dir, float maxT,
+                    float radius, uint32_t *pSphere, float *pT) {
+  float best = maxT;
+  bool hit = false;
+  for (uint32_t i = 0; i < count; ++i) {
+    const float t = raySphere(origin, dir, state.pX[i], state.pY[i],
+                              state.pZ[i], radius);
+    if (t < best) {
+      best = t;
+      *pSphere = i;
+      hit = true;
+    }
+  }
+  if (hit)
+    *pT = best;
+  return hit;
+}
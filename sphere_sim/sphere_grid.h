@@ -0,0 +1,78 @@
+#pragma once
+
+// Uniform grid over the sphere centers, for frustum and ray queries that skip
+// whole cells. The grid is a snapshot of one state. Nothing keeps it current as
+// the spheres move, so it is built when a query needs it.
+
+#include "sphere_sim.h"
+
+constexpr float gGridCellSize = 64.0f;
+// Cells per axis in x and y, centered on the spawn ball's axis.
+constexpr uint32_t gGridCellsXY = 16;
+// z wraps around after gGridCellsZ cells. World z from gGridMinZ to
+// gGridMinZ + gGridCellsZ * gGridCellSize maps onto the ring once, which
+// covers every live sphere as long as a frame moves them less than 1024.
+constexpr uint32_t gGridCellsZ = 64;
+constexpr float gGridMinZ = -1024.0f;
+constexpr uint32_t gGridCellCount = gGridCellsXY * gGridCellsXY * gGridCellsZ;
+// Slack around each cell for rounding in the cell index.
+constexpr float gGridMargin = 1.0f;
+
+static_assert((gGridCellsZ & (gGridCellsZ - 1)) == 0,
+              "the z ring is indexed with a mask");
+static_assert(gGridCellCount <= 65536, "cell indices are stored as uint16_t");
+static_assert(gGridCellsXY * gGridCellSize >= 2.0f * gSpawnRadius,
+              "the grid must cover the spawn ball");
+
+struct SphereGridCell {
+  uint32_t *pSpheres;
+  uint32_t mCount;
+  uint32_t mCapacity;
+};
+
+struct SphereGrid {
+  SphereGridCell *pCells;
+  // Cell of each sphere.
+  uint16_t *pSphereCell;
+  uint32_t mSphereCount;
+};
+
+inline uint32_t sphereGridCell(float x, float y, float z) {
+  const float invCellSize = 1.0f / gGridCellSize;
+  const float halfWidth = 0.5f * gGridCellsXY * gGridCellSize;
+  int32_t ix = (int32_t)floorf((x + halfWidth) * invCellSize);
+  int32_t iy = (int32_t)floorf((y + halfWidth) * invCellSize);
+  ix = ix < 0 ? 0 : (ix >= (int32_t)gGridCellsXY ? gGridCellsXY - 1 : ix);
+  iy = iy < 0 ? 0 : (iy >= (int32_t)gGridCellsXY ? gGridCellsXY - 1 : iy);
+  const uint32_t iz =
+      (uint32_t)(int32_t)floorf(z * invCellSize) & (gGridCellsZ - 1);
+  return (iz * gGridCellsXY + (uint32_t)iy) * gGridCellsXY + (uint32_t)ix;
+}
+
+// Builds the grid over spheres [0, count) of state. The grid must be empty.
+void initSphereGrid(SphereGrid &grid, const SphereState &state,
+                    uint32_t count);
+void exitSphereGrid(SphereGrid &grid);
+
+// World space bounds of a cell's sphere centers, margin included.
+void sphereGridCellBounds(uint32_t cell, float *pMin, float *pMax);
+
+// Writes the indices of the spheres that touch the frustum to pVisible, cell
+// by cell, and returns how many were written. Slices, then rows, then cells
+// outside the frustum are skipped, and spheres in a slice, row or cell fully
+// inside it are not tested.
+uint32_t queryGridFrustum(const SphereGrid &grid, const SphereState &state,
+                          const Frustum &frustum, float radius,
+                          uint32_t *pVisible);
+
+// Finds the first sphere hit by origin + t * dir for t in [0, maxT]. dir must
+// be normalized. Only spheres in cells the ray passes close to are tested,
+// found slice by slice and row by row like queryGridFrustum does.
+bool queryGridRay(const SphereGrid &grid, const SphereState &state,
+                  const float3 &origin, const float3 &dir, float maxT,
+                  float radius, uint32_t *pSphere, float *pT);
+
+// Same result as queryGridRay by testing every sphere.
+bool raycastSpheres(const SphereState &state, uint32_t count,
+                    const float3 &origin, const float3 &dir, float maxT,
+                    float radius, uint32_t *pSphere, float *pT);
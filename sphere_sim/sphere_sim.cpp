@@ -0,0 +1,723 @@
+#include "sphere_sim.h"
+
+#include <cfloat>
+#include <cstring>
+
+#include <OS/Interfaces/IMemory.h>
+#include <OS/Interfaces/IProfiler.h>
+#include <OS/Interfaces/IThread.h>
+
+// Chunks owned by one participant of a parallelFor. Others steal from mNext
+// once their own range runs dry.
+struct alignas(64) ParallelForRange {
+  std::atomic<uint32_t> mNext;
+  uint32_t mEnd;
+};
+
+struct ParallelForData {
+  RangeTaskFunc pTask;
+  void *pUserData;
+  uint32_t mCount;
+  uint32_t mGrainSize;
+  uint32_t mRangeCount;
+  std::atomic<uint32_t> mPendingWorkers;
+  ParallelForRange mRanges[gMaxParallelForThreads];
+};
+
+static void runParallelForChunks(ParallelForData *pFor, uint32_t home) {
+  for (uint32_t r = 0; r < pFor->mRangeCount; ++r) {
+    ParallelForRange &range = pFor->mRanges[(home + r) % pFor->mRangeCount];
+    for (;;) {
+      uint32_t chunk = range.mNext.fetch_add(1, std::memory_order_relaxed);
+      if (chunk >= range.mEnd)
+        break;
+      uint32_t begin = chunk * pFor->mGrainSize;
+      uint32_t end = begin + pFor->mGrainSize < pFor->mCount
+                         ? begin + pFor->mGrainSize
+                         : pFor->mCount;
+      pFor->pTask(pFor->pUserData, begin, end);
+    }
+  }
+}
+
+static void parallelForWorker(void *pData, uintptr_t worker) {
+  auto pFor = static_cast<ParallelForData *>(pData);
+  {
+    PROFILER_SET_CPU_SCOPE("Threads", "Parallel For Worker", 0xFFC8C8FF);
+    runParallelForChunks(pFor, (uint32_t)worker + 1);
+  }
+  pFor->mPendingWorkers.fetch_sub(1, std::memory_order_release);
+}
+
+void parallelFor(ThreadSystem *pThreads, RangeTaskFunc pTask, void *pUserData,
+                 uint32_t count, uint32_t grainSize, uint32_t maxThreads) {
+  if (count == 0)
+    return;
+
+  ParallelForData data;
+  data.pTask = pTask;
+  data.pUserData = pUserData;
+  data.mCount = count;
+  data.mGrainSize = grainSize > 0 ? grainSize : 1;
+
+  if (maxThreads > gMaxParallelForThreads)
+    maxThreads = gMaxParallelForThreads;
+  if (maxThreads < 1)
+    maxThreads = 1;
+
+  uint32_t chunkCount = (count + data.mGrainSize - 1) / data.mGrainSize;
+  uint32_t workerCount = getThreadSystemThreadCount(pThreads);
+  if (workerCount > maxThreads - 1)
+    workerCount = maxThreads - 1;
+  if (workerCount > chunkCount - 1)
+    workerCount = chunkCount - 1;
+
+  data.mRangeCount = workerCount + 1;
+  for (uint32_t r = 0; r < data.mRangeCount; ++r) {
+    data.mRanges[r].mNext.store(chunkCount * r / data.mRangeCount,
+                                std::memory_order_relaxed);
+    data.mRanges[r].mEnd = chunkCount * (r + 1) / data.mRangeCount;
+  }
+  data.mPendingWorkers.store(workerCount, std::memory_order_relaxed);
+
+  if (workerCount > 0)
+    addThreadSystemRangeTask(pThreads, parallelForWorker, &data, workerCount);
+
+  {
+    PROFILER_SET_CPU_SCOPE("Threads", "Parallel For Main", 0xFFC8C8FF);
+    runParallelForChunks(&data, 0);
+  }
+
+  // Workers that have not started yet find nothing left to do; run their
+  // tasks here rather than waiting for a thread to pick them up.
+  while (data.mPendingWorkers.load(std::memory_order_acquire) != 0) {
+    if (!assistThreadSystem(pThreads))
+      _mm_pause();
+  }
+}
+
+static void backgroundParallelForTask(void *pData, uintptr_t) {
+  auto pJob = static_cast<BackgroundParallelFor *>(pData);
+  parallelFor(pJob->pThreads, pJob->pTask, pJob->pUserData, pJob->mCount,
+              pJob->mGrainSize, pJob->mMaxThreads);
+  pJob->mDone.store(true, std::memory_order_release);
+}
+
+void beginParallelFor(BackgroundParallelFor *pJob, ThreadSystem *pThreads,
+                      RangeTaskFunc pTask, void *pUserData, uint32_t count,
+                      uint32_t grainSize, uint32_t maxThreads) {
+  pJob->pThreads = pThreads;
+  pJob->pTask = pTask;
+  pJob->pUserData = pUserData;
+  pJob->mCount = count;
+  pJob->mGrainSize = grainSize;
+  pJob->mMaxThreads = maxThreads;
+  pJob->mDone.store(false, std::memory_order_relaxed);
+  addThreadSystemTask(pThreads, backgroundParallelForTask, pJob);
+}
+
+void waitParallelFor(BackgroundParallelFor *pJob) {
+  while (!pJob->mDone.load(std::memory_order_acquire)) {
+    if (!assistThreadSystem(pJob->pThreads))
+      _mm_pause();
+  }
+}
+
+static inline __m128i mulloEpi32(__m128i a, __m128i b) {
+  __m128i even = _mm_mul_epu32(a, b);
+  __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128i hashUint4(__m128i x) {
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+  x = mulloEpi32(x, _mm_set1_epi32((int)0x7feb352du));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+  x = mulloEpi32(x, _mm_set1_epi32((int)0x846ca68bu));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+  return x;
+}
+
+static inline __m128i sphereRandom4(__m128i key, uint32_t stream) {
+  return hashUint4(_mm_add_epi32(key, _mm_set1_epi32((int)(stream * 0x9e3779b9u))));
+}
+
+static inline __m128 unitFloat4(__m128i bits) {
+  return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(bits, 8)),
+                    _mm_set1_ps(1.0f / 16777216.0f));
+}
+
+static inline __m128 selectPs(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 sinTurns4(__m128 t) {
+  __m128 hi = _mm_cmpgt_ps(t, _mm_set1_ps(0.25f));
+  t = selectPs(hi, _mm_sub_ps(_mm_set1_ps(0.5f), t), t);
+  __m128 lo = _mm_cmplt_ps(t, _mm_set1_ps(-0.25f));
+  t = selectPs(lo, _mm_sub_ps(_mm_set1_ps(-0.5f), t), t);
+  __m128 y = _mm_mul_ps(t, _mm_set1_ps(2.0f * PI));
+  __m128 y2 = _mm_mul_ps(y, y);
+  __m128 p = _mm_add_ps(_mm_set1_ps(-1.0f / 5040.0f),
+                        _mm_mul_ps(y2, _mm_set1_ps(1.0f / 362880.0f)));
+  p = _mm_add_ps(_mm_set1_ps(1.0f / 120.0f), _mm_mul_ps(y2, p));
+  p = _mm_add_ps(_mm_set1_ps(-1.0f / 6.0f), _mm_mul_ps(y2, p));
+  p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(y2, p));
+  return _mm_mul_ps(y, p);
+}
+
+static inline __m128 cosTurns4(__m128 t) {
+  t = _mm_add_ps(t, _mm_set1_ps(0.25f));
+  __m128 wrap = _mm_cmpge_ps(t, _mm_set1_ps(0.5f));
+  t = selectPs(wrap, _mm_sub_ps(t, _mm_set1_ps(1.0f)), t);
+  return sinTurns4(t);
+}
+
+SphereState allocSphereState(uint32_t count) {
+  SphereState state;
+  state.pX = (float *)tf_memalign(32, count * sizeof(float));
+  state.pY = (float *)tf_memalign(32, count * sizeof(float));
+  state.pZ = (float *)tf_memalign(32, count * sizeof(float));
+  state.pColor = (uint32_t *)tf_memalign(32, count * sizeof(uint32_t));
+  return state;
+}
+
+void copySphereState(const SphereState &dst, const SphereState &src,
+                     uint32_t count) {
+  memcpy(dst.pX, src.pX, count * sizeof(float));
+  memcpy(dst.pY, src.pY, count * sizeof(float));
+  memcpy(dst.pZ, src.pZ, count * sizeof(float));
+  memcpy(dst.pColor, src.pColor, count * sizeof(uint32_t));
+}
+
+bool equalSphereState(const SphereState &a, const SphereState &b,
+                      uint32_t count) {
+  return memcmp(a.pX, b.pX, count * sizeof(float)) == 0 &&
+         memcmp(a.pY, b.pY, count * sizeof(float)) == 0 &&
+         memcmp(a.pZ, b.pZ, count * sizeof(float)) == 0 &&
+         memcmp(a.pColor, b.pColor, count * sizeof(uint32_t)) == 0;
+}
+
+void freeSphereState(const SphereState &state) {
+  tf_free(state.pX);
+  tf_free(state.pY);
+  tf_free(state.pZ);
+  tf_free(state.pColor);
+}
+
+uint32_t advanceSpheresScalar(float *pZ, uint32_t begin, uint32_t end,
+                              float dz, uint32_t *pRespawn) {
+  uint32_t respawnCount = 0;
+  for (uint32_t i = begin; i < end; ++i) {
+    if (pZ[i] < 0)
+      pRespawn[respawnCount++] = i;
+    else
+      pZ[i] -= dz;
+  }
+  return respawnCount;
+}
+
+uint32_t advanceSpheresSimd(float *pZ, uint32_t begin, uint32_t end, float dz,
+                            uint32_t *pRespawn) {
+  uint32_t respawnCount = 0;
+  uint32_t i = begin;
+#if defined(__AVX__)
+  const __m256 dz8 = _mm256_set1_ps(dz);
+  const __m256 zero8 = _mm256_setzero_ps();
+  for (; i + 8 <= end; i += 8) {
+    __m256 z = _mm256_loadu_ps(pZ + i);
+    __m256 behind = _mm256_cmp_ps(z, zero8, _CMP_LT_OQ);
+    __m256 moved = _mm256_sub_ps(z, dz8);
+    _mm256_storeu_ps(pZ + i, _mm256_blendv_ps(moved, z, behind));
+
+    int mask = _mm256_movemask_ps(behind);
+    for (uint32_t lane = 0; mask; ++lane, mask >>= 1) {
+      if (mask & 1)
+        pRespawn[respawnCount++] = i + lane;
+    }
+  }
+#endif
+  const __m128 dz4 = _mm_set1_ps(dz);
+  const __m128 zero4 = _mm_setzero_ps();
+  for (; i + 4 <= end; i += 4) {
+    __m128 z = _mm_loadu_ps(pZ + i);
+    __m128 behind = _mm_cmplt_ps(z, zero4);
+    __m128 moved = _mm_sub_ps(z, dz4);
+    _mm_storeu_ps(pZ + i, _mm_or_ps(_mm_and_ps(behind, z),
+                                    _mm_andnot_ps(behind, moved)));
+
+    int mask = _mm_movemask_ps(behind);
+    for (uint32_t lane = 0; mask; ++lane, mask >>= 1) {
+      if (mask & 1)
+        pRespawn[respawnCount++] = i + lane;
+    }
+  }
+  return respawnCount + advanceSpheresScalar(pZ, i, end, dz,
+                                             pRespawn + respawnCount);
+}
+
+void respawnSphereScalar(const SphereState &state, uint32_t i, uint32_t seed,
+                         uint32_t frame) {
+  uint32_t key = sphereRandomKey(seed, i, frame);
+  float cosTheta =
+      unitFloat(sphereRandom(key, RANDOM_STREAM_COS_THETA)) * 2.0f - 1.0f;
+  float sinTheta = sqrtf(1.0f - cosTheta * cosTheta);
+  float phi = unitFloat(sphereRandom(key, RANDOM_STREAM_PHI)) - 0.5f;
+  float r0 = unitFloat(sphereRandom(key, RANDOM_STREAM_RADIUS0));
+  float r1 = unitFloat(sphereRandom(key, RANDOM_STREAM_RADIUS1));
+  float r2 = unitFloat(sphereRandom(key, RANDOM_STREAM_RADIUS2));
+  float r = r0 > r1 ? r0 : r1;
+  r = r > r2 ? r : r2;
+  r = r * gSpawnRadius;
+
+  float rSinTheta = r * sinTheta;
+  state.pX[i] = rSinTheta * cosTurns(phi);
+  state.pY[i] = rSinTheta * sinTurns(phi);
+  state.pZ[i] = r * cosTheta + gSpawnDistance;
+  state.pColor[i] = sphereRandom(key, RANDOM_STREAM_COLOR) | 0xff000000u;
+}
+
+void respawnSpheresSimd(const SphereState &state, const uint32_t *pIndices,
+                        uint32_t count, uint32_t seed, uint32_t frame) {
+  const __m128i frameKey = _mm_set1_epi32((int)hashUint(frame));
+  const __m128i seed4 = _mm_set1_epi32((int)seed);
+  uint32_t n = 0;
+  for (; n + 4 <= count; n += 4) {
+    __m128i sphere = _mm_loadu_si128((const __m128i *)(pIndices + n));
+    __m128i key = hashUint4(
+        _mm_xor_si128(seed4, hashUint4(_mm_xor_si128(sphere, frameKey))));
+
+    __m128 cosTheta = _mm_sub_ps(
+        _mm_mul_ps(unitFloat4(sphereRandom4(key, RANDOM_STREAM_COS_THETA)),
+                   _mm_set1_ps(2.0f)),
+        _mm_set1_ps(1.0f));
+    __m128 sinTheta = _mm_sqrt_ps(
+        _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(cosTheta, cosTheta)));
+    __m128 phi = _mm_sub_ps(unitFloat4(sphereRandom4(key, RANDOM_STREAM_PHI)),
+                            _mm_set1_ps(0.5f));
+    __m128 r0 = unitFloat4(sphereRandom4(key, RANDOM_STREAM_RADIUS0));
+    __m128 r1 = unitFloat4(sphereRandom4(key, RANDOM_STREAM_RADIUS1));
+    __m128 r2 = unitFloat4(sphereRandom4(key, RANDOM_STREAM_RADIUS2));
+    __m128 r = _mm_max_ps(_mm_max_ps(r0, r1), r2);
+    r = _mm_mul_ps(r, _mm_set1_ps(gSpawnRadius));
+
+    __m128 rSinTheta = _mm_mul_ps(r, sinTheta);
+    alignas(16) float x[4], y[4], z[4];
+    alignas(16) uint32_t color[4];
+    _mm_store_ps(x, _mm_mul_ps(rSinTheta, cosTurns4(phi)));
+    _mm_store_ps(y, _mm_mul_ps(rSinTheta, sinTurns4(phi)));
+    _mm_store_ps(z, _mm_add_ps(_mm_mul_ps(r, cosTheta),
+                               _mm_set1_ps(gSpawnDistance)));
+    _mm_store_si128((__m128i *)color,
+                    _mm_or_si128(sphereRandom4(key, RANDOM_STREAM_COLOR),
+                                 _mm_set1_epi32((int)0xff000000u)));
+    for (uint32_t lane = 0; lane < 4; ++lane) {
+      uint32_t i = pIndices[n + lane];
+      state.pX[i] = x[lane];
+      state.pY[i] = y[lane];
+      state.pZ[i] = z[lane];
+      state.pColor[i] = color[lane];
+    }
+  }
+  for (; n < count; ++n)
+    respawnSphereScalar(state, pIndices[n], seed, frame);
+}
+
+uint32_t sphereRespawnCount(const SphereRespawnLog &log, uint32_t count) {
+  const uint32_t blockCount = sphereBlockCount(count);
+  uint32_t respawnCount = 0;
+  for (uint32_t b = 0; b < blockCount; ++b)
+    respawnCount += log.pBlockCount[b];
+  return respawnCount;
+}
+
+void updateSpheres(const SphereState &state, uint32_t begin, uint32_t end,
+                   float dz, uint32_t seed, uint32_t frame, bool simd,
+                   const SphereRespawnLog *pLog) {
+  for (uint32_t blockBegin = begin; blockBegin < end;
+       blockBegin += gSphereBlockSize) {
+    const uint32_t blockEnd = blockBegin + gSphereBlockSize < end
+                                  ? blockBegin + gSphereBlockSize
+                                  : end;
+
+    uint32_t respawn[gSphereBlockSize];
+    uint32_t respawnCount = 0;
+    if (simd) {
+      respawnCount =
+          advanceSpheresSimd(state.pZ, blockBegin, blockEnd, dz, respawn);
+      respawnSpheresSimd(state, respawn, respawnCount, seed, frame);
+    } else {
+      respawnCount =
+          advanceSpheresScalar(state.pZ, blockBegin, blockEnd, dz, respawn);
+      for (uint32_t r = 0; r < respawnCount; ++r)
+        respawnSphereScalar(state, respawn[r], seed, frame);
+    }
+
+    if (pLog) {
+      memcpy(pLog->pSpheres + blockBegin, respawn,
+             respawnCount * sizeof(uint32_t));
+      pLog->pBlockCount[blockBegin / gSphereBlockSize] = respawnCount;
+    }
+  }
+}
+
+void updateSpheresInto(const SphereState &dst, const SphereState &src,
+                       uint32_t begin, uint32_t end, float dz, uint32_t seed,
+                       uint32_t frame, bool simd,
+                       const SphereRespawnLog *pLog) {
+  for (uint32_t blockBegin = begin; blockBegin < end;
+       blockBegin += gSphereBlockSize) {
+    const uint32_t blockEnd = blockBegin + gSphereBlockSize < end
+                                  ? blockBegin + gSphereBlockSize
+                                  : end;
+    const uint32_t count = blockEnd - blockBegin;
+    memcpy(dst.pX + blockBegin, src.pX + blockBegin, count * sizeof(float));
+    memcpy(dst.pY + blockBegin, src.pY + blockBegin, count * sizeof(float));
+    memcpy(dst.pZ + blockBegin, src.pZ + blockBegin, count * sizeof(float));
+    memcpy(dst.pColor + blockBegin, src.pColor + blockBegin,
+           count * sizeof(uint32_t));
+    updateSpheres(dst, blockBegin, blockEnd, dz, seed, frame, simd, pLog);
+  }
+}
+
+bool sphereKernelsMatch(const SphereState &state, uint32_t count, float dz,
+                        uint32_t seed, uint32_t frameCount) {
+  SphereState scalar = allocSphereState(count);
+  SphereState simd = allocSphereState(count);
+  copySphereState(scalar, state, count);
+  copySphereState(simd, state, count);
+
+  bool match = true;
+  for (uint32_t frame = 0; frame < frameCount && match; ++frame) {
+    updateSpheres(scalar, 0, count, dz, seed, frame, false);
+    updateSpheres(simd, 0, count, dz, seed, frame, true);
+    match = equalSphereState(scalar, simd, count);
+  }
+
+  freeSphereState(scalar);
+  freeSphereState(simd);
+  return match;
+}
+
+Frustum extractFrustum(const mat4 &projView) {
+  const vec4 r0 = projView.getRow(0);
+  const vec4 r1 = projView.getRow(1);
+  const vec4 r2 = projView.getRow(2);
+  const vec4 r3 = projView.getRow(3);
+  // Clip space z is in [0, w], so the depth planes are z and w - z.
+  const vec4 planes[6] = {r3 + r0, r3 - r0, r3 + r1, r3 - r1, r2, r3 - r2};
+
+  Frustum frustum;
+  for (uint32_t p = 0; p < 6; ++p) {
+    const float invLength = 1.0f / length(planes[p].getXYZ());
+    frustum.mPlanes[p][0] = planes[p].getX() * invLength;
+    frustum.mPlanes[p][1] = planes[p].getY() * invLength;
+    frustum.mPlanes[p][2] = planes[p].getZ() * invLength;
+    frustum.mPlanes[p][3] = planes[p].getW() * invLength;
+  }
+  return frustum;
+}
+
+uint32_t cullSpheres(const SphereState &state, uint32_t begin, uint32_t end,
+                     const Frustum &frustum, float radius,
+                     uint32_t *pVisible) {
+  uint32_t visibleCount = 0;
+  uint32_t i = begin;
+  const __m128 minDistance = _mm_set1_ps(-radius);
+  for (; i + 4 <= end; i += 4) {
+    const __m128 x = _mm_loadu_ps(state.pX + i);
+    const __m128 y = _mm_loadu_ps(state.pY + i);
+    const __m128 z = _mm_loadu_ps(state.pZ + i);
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (uint32_t p = 0; p < 6; ++p) {
+      const float *plane = frustum.mPlanes[p];
+      __m128 distance = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane[0])),
+                     _mm_mul_ps(y, _mm_set1_ps(plane[1]))),
+          _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane[2])),
+                     _mm_set1_ps(plane[3])));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, minDistance));
+    }
+
+    int mask = _mm_movemask_ps(inside);
+    for (uint32_t lane = 0; mask; ++lane, mask >>= 1) {
+      if (mask & 1)
+        pVisible[visibleCount++] = i + lane;
+    }
+  }
+  for (; i < end; ++i) {
+    if (sphereInFrustum(frustum, state.pX[i], state.pY[i], state.pZ[i],
+                        radius))
+      pVisible[visibleCount++] = i;
+  }
+  return visibleCount;
+}
+
+LodSelection makeLodSelection(const mat4 &projView, float pixelsPerUnit,
+                              float impostorDepth) {
+  const vec4 r3 = projView.getRow(3);
+  LodSelection selection;
+  selection.mDepthRow[0] = r3.getX();
+  selection.mDepthRow[1] = r3.getY();
+  selection.mDepthRow[2] = r3.getZ();
+  selection.mDepthRow[3] = r3.getW();
+  for (uint32_t l = 0; l < 4; ++l) {
+    const float maxDepth =
+        l + 1 < gSphereMeshLodCount
+            ? 2.0f * gSphereRadius * pixelsPerUnit / gLodSwitchPixels[l]
+            : FLT_MAX;
+    selection.mMaxDepth[l] = maxDepth < impostorDepth ? maxDepth : impostorDepth;
+  }
+  return selection;
+}
+
+void classifySpheres(const SphereFrame &frame, uint32_t begin, uint32_t end) {
+  const SphereState &state = frame.mState;
+  for (uint32_t blockBegin = begin; blockBegin < end;
+       blockBegin += gSphereBlockSize) {
+    const uint32_t blockEnd = blockBegin + gSphereBlockSize < end
+                                  ? blockBegin + gSphereBlockSize
+                                  : end;
+
+    uint32_t visible[gSphereBlockSize];
+    uint32_t visibleCount = 0;
+    if (frame.mCull) {
+      visibleCount = cullSpheres(state, blockBegin, blockEnd, frame.mFrustum,
+                                 gSphereRadius, visible);
+    } else {
+      for (uint32_t i = blockBegin; i < blockEnd; ++i)
+        visible[visibleCount++] = i;
+    }
+
+    uint8_t *pLod = frame.pSphereLod;
+    memset(pLod + blockBegin, gSphereLodCount, blockEnd - blockBegin);
+    uint32_t *pLodCount =
+        frame.pBlockLodCount + blockBegin / gSphereBlockSize * gSphereLodCount;
+    for (uint32_t l = 0; l < gSphereLodCount; ++l)
+      pLodCount[l] = 0;
+    for (uint32_t v = 0; v < visibleCount; ++v) {
+      const uint32_t i = visible[v];
+      const float depth = sphereViewDepth(frame.mLodSelection, state.pX[i],
+                                          state.pY[i], state.pZ[i]);
+      const uint32_t lod = selectLodAtDepth(frame.mLodSelection, depth);
+      pLod[i] = (uint8_t)lod;
+      ++pLodCount[lod];
+      if (frame.pSphereDepth)
+        frame.pSphereDepth[i] = sphereSortKey(depth);
+    }
+  }
+}
+
+void updateSphereFrameRange(void *pData, uint32_t begin, uint32_t end) {
+  auto pFrame = static_cast<const SphereFrame *>(pData);
+  updateSpheres(pFrame->mState, begin, end, pFrame->mDeltaZ, pFrame->mSeed,
+                pFrame->mFrame, pFrame->mSimd, pFrame->pRespawnLog);
+  classifySpheres(*pFrame, begin, end);
+}
+
+void cullSphereFrameRange(void *pData, uint32_t begin, uint32_t end) {
+  classifySpheres(*static_cast<const SphereFrame *>(pData), begin, end);
+}
+
+void stepSphereRange(void *pData, uint32_t begin, uint32_t end) {
+  auto pStep = static_cast<const SphereStep *>(pData);
+  updateSpheresInto(pStep->mDst, pStep->mSrc, begin, end, pStep->mDeltaZ,
+                    pStep->mSeed, pStep->mFrame, pStep->mSimd,
+                    pStep->pRespawnLog);
+}
+
+void spawnSphereRange(void *pData, uint32_t begin, uint32_t end) {
+  auto pSpawn = static_cast<const SphereSpawn *>(pData);
+  uint32_t indices[gSphereBlockSize];
+  for (uint32_t blockBegin = begin; blockBegin < end;
+       blockBegin += gSphereBlockSize) {
+    uint32_t count = 0;
+    for (uint32_t i = blockBegin; i < end && count < gSphereBlockSize; ++i)
+      indices[count++] = pSpawn->mFirst + i;
+    respawnSpheresSimd(pSpawn->mState, indices, count, pSpawn->mSeed,
+                       pSpawn->mFrame);
+  }
+}
+
+uint32_t countVisibleSpheres(const uint32_t *pBlockLodCount, uint32_t count,
+                             uint32_t *pLodVisibleCount,
+                             uint32_t *pLodInstanceOffset,
+                             uint32_t *pBlockLodOffset) {
+  const uint32_t blockCount = sphereBlockCount(count);
+  for (uint32_t l = 0; l < gSphereLodCount; ++l)
+    pLodVisibleCount[l] = 0;
+  for (uint32_t b = 0; b < blockCount; ++b) {
+    for (uint32_t l = 0; l < gSphereLodCount; ++l)
+      pLodVisibleCount[l] += pBlockLodCount[b * gSphereLodCount + l];
+  }
+  uint32_t visibleCount = 0;
+  uint32_t lodOffset[gSphereLodCount];
+  for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+    pLodInstanceOffset[l] = visibleCount;
+    lodOffset[l] = visibleCount;
+    visibleCount += pLodVisibleCount[l];
+  }
+  for (uint32_t b = 0; b < blockCount; ++b) {
+    for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+      pBlockLodOffset[b * gSphereLodCount + l] = lodOffset[l];
+      lodOffset[l] += pBlockLodCount[b * gSphereLodCount + l];
+    }
+  }
+  return visibleCount;
+}
+
+__m128i floatToHalf(__m128 f) {
+#if defined(__F16C__) || defined(__AVX2__)
+  return _mm_cvtepu16_epi32(_mm_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+#else
+  // Fabian Giesen's float_to_half_fast3_rtne, four lanes at a time.
+  const __m128i f16Max = _mm_set1_epi32((127 + 16) << 23);
+  const __m128i minNormal = _mm_set1_epi32((127 - 14) << 23);
+  const __m128i subnormalMagic =
+      _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+  const __m128i normalBias = _mm_set1_epi32(0xfff - ((127 - 15) << 23));
+
+  const __m128 sign = _mm_and_ps(f, _mm_set1_ps(-0.0f));
+  const __m128 absF = _mm_xor_ps(f, sign);
+  const __m128i absBits = _mm_castps_si128(absF);
+  const __m128i isNan = _mm_castps_si128(_mm_cmpunord_ps(absF, absF));
+  const __m128i isRegular = _mm_cmpgt_epi32(f16Max, absBits);
+  const __m128i infOrNan = _mm_or_si128(
+      _mm_and_si128(isNan, _mm_set1_epi32(0x200)), _mm_set1_epi32(0x7c00));
+  const __m128i isSubnormal = _mm_cmpgt_epi32(minNormal, absBits);
+
+  // Subnormal results: let the FPU do the rounding shift.
+  const __m128i subnormal = _mm_sub_epi32(
+      _mm_castps_si128(_mm_add_ps(absF, _mm_castsi128_ps(subnormalMagic))),
+      subnormalMagic);
+  // Normal results: rebias the exponent and round the mantissa to even.
+  const __m128i mantissaOdd =
+      _mm_srai_epi32(_mm_slli_epi32(absBits, 31 - 13), 31);
+  const __m128i normal = _mm_srli_epi32(
+      _mm_sub_epi32(_mm_add_epi32(absBits, normalBias), mantissaOdd), 13);
+
+  const __m128i finite = _mm_or_si128(_mm_and_si128(isSubnormal, subnormal),
+                                      _mm_andnot_si128(isSubnormal, normal));
+  const __m128i half = _mm_or_si128(_mm_and_si128(isRegular, finite),
+                                    _mm_andnot_si128(isRegular, infOrNan));
+  return _mm_or_si128(half,
+                      _mm_srli_epi32(_mm_castps_si128(sign), 16));
+#endif
+}
+
+static SphereInstance packInstance(float x, float y, float z, uint32_t color,
+                                   __m128 origin) {
+  const __m128 halfMax = _mm_set1_ps(gHalfMax);
+  const __m128 halfMin = _mm_set1_ps(-gHalfMax);
+  const __m128 offset = _mm_min_ps(
+      _mm_max_ps(_mm_sub_ps(_mm_setr_ps(x, y, z, 0.0f), origin), halfMin),
+      halfMax);
+  const __m128i half = floatToHalf(offset);
+  // Lane 0 gets x | y << 16, lane 2 z | w << 16 with w zero.
+  const __m128i pairs = _mm_or_si128(half, _mm_srli_epi64(half, 16));
+  SphereInstance instance;
+  instance.mPositionXY = (uint32_t)_mm_cvtsi128_si32(pairs);
+  instance.mPositionZ =
+      (uint32_t)_mm_cvtsi128_si32(_mm_unpackhi_epi64(pairs, pairs));
+  instance.mColor = color;
+  return instance;
+}
+
+static __m128 originLanes(const float3 &origin) {
+  return _mm_setr_ps(origin.x, origin.y, origin.z, 0.0f);
+}
+
+SphereInstance packSphereInstance(float x, float y, float z, uint32_t color,
+                                  const float3 &origin) {
+  return packInstance(x, y, z, color, originLanes(origin));
+}
+
+// The destination is usually write-combined upload memory that is never read
+// back, so records are streamed past the cache.
+static void streamInstance(SphereInstance *pDst,
+                           const SphereInstance &instance) {
+  int *pWords = (int *)pDst;
+  _mm_stream_si32(pWords, (int)instance.mPositionXY);
+  _mm_stream_si32(pWords + 1, (int)instance.mPositionZ);
+  _mm_stream_si32(pWords + 2, (int)instance.mColor);
+}
+
+void writeSphereInstances(const SphereFrame &frame, uint32_t begin,
+                          uint32_t end) {
+  const SphereState &state = frame.mState;
+  const __m128 origin = originLanes(frame.mInstanceOrigin);
+  for (uint32_t blockBegin = begin; blockBegin < end;
+       blockBegin += gSphereBlockSize) {
+    const uint32_t blockEnd = blockBegin + gSphereBlockSize < end
+                                  ? blockBegin + gSphereBlockSize
+                                  : end;
+
+    uint32_t offset[gSphereLodCount];
+    memcpy(offset,
+           frame.pBlockLodOffset +
+               blockBegin / gSphereBlockSize * gSphereLodCount,
+           sizeof(uint32_t) * gSphereLodCount);
+    for (uint32_t i = blockBegin; i < blockEnd; ++i) {
+      const uint32_t lod = frame.pSphereLod[i];
+      if (lod == gSphereLodCount)
+        continue;
+      streamInstance(frame.pInstances + offset[lod]++,
+                     packInstance(state.pX[i], state.pY[i], state.pZ[i],
+                                  state.pColor[i], origin));
+    }
+  }
+  // Streaming stores are weakly ordered; make them visible before the caller
+  // reports the range as done.
+  _mm_sfence();
+}
+
+void writeSphereFrameRange(void *pData, uint32_t begin, uint32_t end) {
+  writeSphereInstances(*static_cast<const SphereFrame *>(pData), begin, end);
+}
+
+void writeSphereSortKeys(const SphereFrame &frame, uint32_t begin,
+                         uint32_t end) {
+  for (uint32_t blockBegin = begin; blockBegin < end;
+       blockBegin += gSphereBlockSize) {
+    const uint32_t blockEnd = blockBegin + gSphereBlockSize < end
+                                  ? blockBegin + gSphereBlockSize
+                                  : end;
+
+    uint32_t offset[gSphereLodCount];
+    memcpy(offset,
+           frame.pBlockLodOffset +
+               blockBegin / gSphereBlockSize * gSphereLodCount,
+           sizeof(uint32_t) * gSphereLodCount);
+    for (uint32_t i = blockBegin; i < blockEnd; ++i) {
+      const uint32_t lod = frame.pSphereLod[i];
+      if (lod == gSphereLodCount)
+        continue;
+      const uint32_t slot = offset[lod]++;
+      frame.pSortKeys[slot] = frame.pSphereDepth[i];
+      frame.pSortSpheres[slot] = i;
+    }
+  }
+}
+
+void writeSphereSortKeyRange(void *pData, uint32_t begin, uint32_t end) {
+  writeSphereSortKeys(*static_cast<const SphereFrame *>(pData), begin, end);
+}
+
+void writeSortedSphereInstances(const SphereFrame &frame, uint32_t begin,
+                                uint32_t end) {
+  const SphereState &state = frame.mState;
+  const __m128 origin = originLanes(frame.mInstanceOrigin);
+  for (uint32_t slot = begin; slot < end; ++slot) {
+    const uint32_t i = frame.pSortSpheres[slot];
+    streamInstance(frame.pInstances + slot,
+                   packInstance(state.pX[i], state.pY[i], state.pZ[i],
+                                state.pColor[i], origin));
+  }
+  _mm_sfence();
+}
+
+void writeSortedSphereFrameRange(void *pData, uint32_t begin, uint32_t end) {
+  writeSortedSphereInstances(*static_cast<const SphereFrame *>(pData), begin,
+                             end);
+}
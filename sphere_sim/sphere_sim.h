@@ -0,0 +1,391 @@
+#pragma once
+
+// CPU side of the sphere simulation: sphere state, the update and respawn
+// kernels, frustum culling, LOD selection and instance packing. Nothing in
+// here touches the renderer, so it is shared by sphere_forge and sphere_bench.
+
+#include <atomic>
+#include <cfloat>
+#include <cstdint>
+
+#include <immintrin.h>
+
+#include <OS/Core/ThreadSystem.h>
+#include <OS/Math/MathTypes.h>
+
+constexpr float gSpawnRadius = 500.0f;
+constexpr float gSpawnDistance = 1000.0f;
+constexpr float gSphereRadius = 1.0f;
+
+// Spheres the update kernel processes between respawn passes.
+constexpr uint32_t gSphereBlockSize = 64;
+
+// Upper bound on threads taking part in one parallelFor, main thread included.
+constexpr uint32_t gMaxParallelForThreads = 64;
+
+// Finest first. The last level has no mesh: its spheres are drawn as
+// screen-space impostors, camera-facing quads ray traced per pixel.
+constexpr uint32_t gSphereMeshLodCount = 3;
+constexpr uint32_t gSphereLodCount = gSphereMeshLodCount + 1;
+constexpr uint32_t gSphereImpostorLod = gSphereMeshLodCount;
+// Projected sphere diameter in pixels below which the next mesh level is used.
+constexpr float gLodSwitchPixels[gSphereMeshLodCount - 1] = {24.0f, 8.0f};
+
+// Per-sphere record, stored back to back in one structured buffer per frame.
+// The position is relative to a per-frame origin, normally the camera, as
+// three halves: x and y in mPositionXY, low half first, and z in the low half
+// of mPositionZ. Color is RGBA8 packed into a single uint.
+struct SphereInstance {
+  uint32_t mPositionXY;
+  uint32_t mPositionZ;
+  uint32_t mColor;
+};
+static_assert(sizeof(SphereInstance) == 12,
+              "SphereInstance must match the HLSL structured buffer stride");
+
+// Largest finite half. Offsets are clamped to it.
+constexpr float gHalfMax = 65504.0f;
+
+// Converts four floats to halves, rounding to nearest even, into the low 16
+// bits of each lane. Same bits as F16C for every finite input.
+__m128i floatToHalf(__m128 f);
+
+// The record of a sphere at (x, y, z), relative to origin.
+SphereInstance packSphereInstance(float x, float y, float z, uint32_t color,
+                                  const float3 &origin);
+
+typedef void (*RangeTaskFunc)(void *pUserData, uint32_t begin, uint32_t end);
+
+// Runs pTask over [0, count) in chunks of grainSize. Chunks are split evenly
+// between the ThreadSystem workers and the calling thread, which also works
+// instead of sitting idle. Idle participants steal chunks from the others.
+// At most maxThreads threads take part, the calling thread included.
+void parallelFor(ThreadSystem *pThreads, RangeTaskFunc pTask, void *pUserData,
+                 uint32_t count, uint32_t grainSize,
+                 uint32_t maxThreads = gMaxParallelForThreads);
+
+// A parallelFor that runs in the background. One ThreadSystem task runs the
+// parallelFor, so the calling thread is free until waitParallelFor.
+struct BackgroundParallelFor {
+  ThreadSystem *pThreads;
+  RangeTaskFunc pTask;
+  void *pUserData;
+  uint32_t mCount;
+  uint32_t mGrainSize;
+  uint32_t mMaxThreads;
+  std::atomic<bool> mDone;
+};
+
+// pJob and pUserData must stay alive until waitParallelFor returns. At most
+// maxThreads threads take part, the one running the task included, so other
+// work can be given the rest.
+void beginParallelFor(BackgroundParallelFor *pJob, ThreadSystem *pThreads,
+                      RangeTaskFunc pTask, void *pUserData, uint32_t count,
+                      uint32_t grainSize,
+                      uint32_t maxThreads = gMaxParallelForThreads);
+// Runs queued ThreadSystem tasks on the calling thread until pJob is done.
+void waitParallelFor(BackgroundParallelFor *pJob);
+
+// Counter-based RNG for respawns. Every value is a pure function of
+// (seed, sphere, frame, stream), so worker threads share no generator state
+// and a run is reproducible from its seed.
+enum RandomStream : uint32_t {
+  RANDOM_STREAM_COS_THETA = 0,
+  RANDOM_STREAM_PHI,
+  RANDOM_STREAM_RADIUS0,
+  RANDOM_STREAM_RADIUS1,
+  RANDOM_STREAM_RADIUS2,
+  RANDOM_STREAM_COLOR,
+};
+
+// lowbias32 integer hash by Chris Wellons. Fixed shifts only, so it maps
+// directly onto SSE2 and HLSL.
+inline uint32_t hashUint(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+inline uint32_t sphereRandomKey(uint32_t seed, uint32_t sphere,
+                                uint32_t frame) {
+  return hashUint(seed ^ hashUint(sphere ^ hashUint(frame)));
+}
+
+inline uint32_t sphereRandom(uint32_t key, uint32_t stream) {
+  return hashUint(key + stream * 0x9e3779b9u);
+}
+
+// [0, 1) from the top 24 bits.
+inline float unitFloat(uint32_t bits) {
+  return (float)(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+// sin(2 * PI * t) for t in [-0.5, 0.5], degree 9 odd polynomial.
+inline float sinTurns(float t) {
+  if (t > 0.25f)
+    t = 0.5f - t;
+  else if (t < -0.25f)
+    t = -0.5f - t;
+  float y = t * (2.0f * PI);
+  float y2 = y * y;
+  return y * (1.0f +
+              y2 * (-1.0f / 6.0f +
+                    y2 * (1.0f / 120.0f +
+                          y2 * (-1.0f / 5040.0f + y2 * (1.0f / 362880.0f)))));
+}
+
+// cos(2 * PI * t) for t in [-0.5, 0.5).
+inline float cosTurns(float t) {
+  t += 0.25f;
+  if (t >= 0.5f)
+    t -= 1.0f;
+  return sinTurns(t);
+}
+
+// Sphere state, one contiguous array per component.
+struct SphereState {
+  float *pX;
+  float *pY;
+  float *pZ;
+  uint32_t *pColor;
+};
+
+SphereState allocSphereState(uint32_t count);
+void copySphereState(const SphereState &dst, const SphereState &src,
+                     uint32_t count);
+bool equalSphereState(const SphereState &a, const SphereState &b,
+                      uint32_t count);
+void freeSphereState(const SphereState &state);
+
+// Moves spheres [begin, end) toward the camera by dz. Spheres already behind
+// the camera are left in place and their indices are written to pRespawn.
+// Returns the number of indices written.
+uint32_t advanceSpheresScalar(float *pZ, uint32_t begin, uint32_t end,
+                              float dz, uint32_t *pRespawn);
+// Same contract and bit-identical output as advanceSpheresScalar, 8 spheres
+// per iteration with AVX or 4 with SSE2.
+uint32_t advanceSpheresSimd(float *pZ, uint32_t begin, uint32_t end, float dz,
+                            uint32_t *pRespawn);
+
+// Places sphere i uniformly inside the spawn ball, without rejection:
+// direction from a uniform cos(theta) and phi, radius as the max of three
+// uniforms, whose distribution is r^3 like the volume of a ball.
+void respawnSphereScalar(const SphereState &state, uint32_t i, uint32_t seed,
+                         uint32_t frame);
+// Same as respawnSphereScalar for four spheres at a time, bit-identical.
+void respawnSpheresSimd(const SphereState &state, const uint32_t *pIndices,
+                        uint32_t count, uint32_t seed, uint32_t frame);
+
+// Spheres respawned by an update, per gSphereBlockSize block: block b's are
+// at pSpheres + b * gSphereBlockSize, pBlockCount[b] of them.
+struct SphereRespawnLog {
+  uint32_t *pSpheres;
+  uint32_t *pBlockCount;
+};
+
+// Total respawns recorded in log by an update of count spheres.
+uint32_t sphereRespawnCount(const SphereRespawnLog &log, uint32_t count);
+
+// Advances and respawns spheres [begin, end) of state. With pLog, begin must
+// be a multiple of gSphereBlockSize and the respawns are recorded there.
+void updateSpheres(const SphereState &state, uint32_t begin, uint32_t end,
+                   float dz, uint32_t seed, uint32_t frame, bool simd,
+                   const SphereRespawnLog *pLog = nullptr);
+
+// Writes spheres [begin, end) of src, advanced and respawned, to dst. Blocks
+// are copied before they are updated, so this costs little over updateSpheres
+// and lets src be read while dst is written.
+void updateSpheresInto(const SphereState &dst, const SphereState &src,
+                       uint32_t begin, uint32_t end, float dz, uint32_t seed,
+                       uint32_t frame, bool simd,
+                       const SphereRespawnLog *pLog = nullptr);
+
+// Runs frameCount frames of the scalar and SIMD update, respawns included, on
+// copies of state and returns whether they agree bit for bit.
+bool sphereKernelsMatch(const SphereState &state, uint32_t count, float dz,
+                        uint32_t seed, uint32_t frameCount);
+
+// Normalized planes (xyz normal, w distance) with the inside on the positive
+// side: left, right, bottom, top, far, near.
+struct Frustum {
+  float mPlanes[6][4];
+};
+
+Frustum extractFrustum(const mat4 &projView);
+
+inline bool sphereInFrustum(const Frustum &frustum, float x, float y, float z,
+                            float radius) {
+  for (uint32_t p = 0; p < 6; ++p) {
+    const float *plane = frustum.mPlanes[p];
+    if ((plane[0] * x + plane[1] * y) + (plane[2] * z + plane[3]) < -radius)
+      return false;
+  }
+  return true;
+}
+
+// Writes the indices of spheres [begin, end) that touch the frustum to
+// pVisible, in order, and returns how many were written.
+uint32_t cullSpheres(const SphereState &state, uint32_t begin, uint32_t end,
+                     const Frustum &frustum, float radius,
+                     uint32_t *pVisible);
+
+// View depth is w = dot(mDepthRow, (x, y, z, 1)). A sphere uses the LOD given
+// by how many mMaxDepth entries its depth is beyond.
+struct LodSelection {
+  float mDepthRow[4];
+  float mMaxDepth[4];
+};
+static_assert(gSphereLodCount <= 5, "LodSelection holds four switch depths");
+
+// pixelsPerUnit is the projected size in pixels of one unit at depth 1.
+// Spheres deeper than impostorDepth use gSphereImpostorLod, so FLT_MAX turns
+// impostors off.
+LodSelection makeLodSelection(const mat4 &projView, float pixelsPerUnit,
+                              float impostorDepth = FLT_MAX);
+
+inline float sphereViewDepth(const LodSelection &selection, float x, float y,
+                             float z) {
+  const float *row = selection.mDepthRow;
+  return (row[0] * x + row[1] * y) + (row[2] * z + row[3]);
+}
+
+inline uint32_t selectLodAtDepth(const LodSelection &selection, float w) {
+  uint32_t lod = 0;
+  while (lod + 1 < gSphereLodCount && w > selection.mMaxDepth[lod])
+    ++lod;
+  return lod;
+}
+
+inline uint32_t selectLod(const LodSelection &selection, float x, float y,
+                          float z) {
+  return selectLodAtDepth(selection, sphereViewDepth(selection, x, y, z));
+}
+
+// View depths from 0 to gSphereSortMaxDepth map linearly onto 16-bit sort
+// keys. Everything past it, which the far plane at 1000 culls anyway, shares
+// the last key.
+constexpr uint32_t gSphereSortKeyBits = 16;
+constexpr float gSphereSortMaxDepth = 1024.0f;
+
+inline uint16_t sphereSortKey(float w) {
+  const float maxKey = (float)((1u << gSphereSortKeyBits) - 1);
+  const float key = w * (maxKey / gSphereSortMaxDepth);
+  return (uint16_t)(key > 0.0f ? (key < maxKey ? key : maxKey) : 0.0f);
+}
+
+// Everything one CPU simulation frame reads and writes.
+struct SphereFrame {
+  SphereState mState;
+  // LOD of each sphere, gSphereLodCount for culled ones.
+  uint8_t *pSphereLod;
+  // Visible spheres per gSphereBlockSize block and LOD.
+  uint32_t *pBlockLodCount;
+  // Where each block's spheres of each LOD start in pInstances.
+  uint32_t *pBlockLodOffset;
+  // Visible spheres, one contiguous range per LOD. In the app this is the
+  // frame's persistently mapped instance buffer.
+  SphereInstance *pInstances;
+  float mDeltaZ;
+  uint32_t mSeed;
+  uint32_t mFrame;
+  bool mSimd;
+  bool mCull;
+  Frustum mFrustum;
+  LodSelection mLodSelection;
+  // World position the instance positions are relative to.
+  float3 mInstanceOrigin;
+  // Optional, filled in by the update.
+  const SphereRespawnLog *pRespawnLog;
+  // Optional, for drawing front to back: the sort key of each visible
+  // sphere, filled in by classifySpheres, and the (key, sphere) pairs of the
+  // visible spheres at their slots, filled in by writeSphereSortKeys.
+  uint16_t *pSphereDepth;
+  uint32_t *pSortKeys;
+  uint32_t *pSortSpheres;
+};
+
+inline uint32_t sphereBlockCount(uint32_t count) {
+  return (count + gSphereBlockSize - 1) / gSphereBlockSize;
+}
+
+// Culls spheres [begin, end) and selects the LOD of the visible ones, filling
+// in pSphereLod, pBlockLodCount and, if set, pSphereDepth. begin must be a
+// multiple of gSphereBlockSize.
+void classifySpheres(const SphereFrame &frame, uint32_t begin, uint32_t end);
+
+// RangeTaskFunc taking a SphereFrame: updates spheres [begin, end), then
+// classifies them. Grain sizes must be multiples of gSphereBlockSize.
+void updateSphereFrameRange(void *pData, uint32_t begin, uint32_t end);
+
+// RangeTaskFunc taking a SphereFrame: classifies spheres [begin, end) without
+// updating them.
+void cullSphereFrameRange(void *pData, uint32_t begin, uint32_t end);
+
+// One out-of-place simulation step, mSrc to mDst.
+struct SphereStep {
+  SphereState mSrc;
+  SphereState mDst;
+  float mDeltaZ;
+  uint32_t mSeed;
+  uint32_t mFrame;
+  bool mSimd;
+  // Optional, filled in by the step.
+  const SphereRespawnLog *pRespawnLog;
+};
+
+// RangeTaskFunc taking a SphereStep. Grain sizes must be multiples of
+// gSphereBlockSize.
+void stepSphereRange(void *pData, uint32_t begin, uint32_t end);
+
+// Spheres mFirst + [begin, end) of mState, spawned afresh.
+struct SphereSpawn {
+  SphereState mState;
+  uint32_t mFirst;
+  uint32_t mSeed;
+  uint32_t mFrame;
+};
+
+// RangeTaskFunc taking a SphereSpawn. Same result as respawnSphereScalar on
+// every sphere of the range.
+void spawnSphereRange(void *pData, uint32_t begin, uint32_t end);
+
+// Sums the per-block counts of the last classifySpheres into
+// pLodVisibleCount, sets pLodInstanceOffset to where each LOD starts in the
+// instances and pBlockLodOffset to where each block's spheres of each LOD go.
+// Returns the total visible count.
+uint32_t countVisibleSpheres(const uint32_t *pBlockLodCount, uint32_t count,
+                             uint32_t *pLodVisibleCount,
+                             uint32_t *pLodInstanceOffset,
+                             uint32_t *pBlockLodOffset);
+
+// Writes the visible spheres of [begin, end) to their final slots in
+// frame.pInstances with streaming stores, in sphere order within each LOD.
+// Needs pBlockLodOffset from countVisibleSpheres. begin must be a multiple of
+// gSphereBlockSize.
+void writeSphereInstances(const SphereFrame &frame, uint32_t begin,
+                          uint32_t end);
+
+// RangeTaskFunc taking a SphereFrame, for writeSphereInstances.
+void writeSphereFrameRange(void *pData, uint32_t begin, uint32_t end);
+
+// Writes the sort key and index of the visible spheres of [begin, end) to
+// their slots in frame.pSortKeys and frame.pSortSpheres, the same slots
+// writeSphereInstances would use. Needs pBlockLodOffset from
+// countVisibleSpheres. begin must be a multiple of gSphereBlockSize.
+void writeSphereSortKeys(const SphereFrame &frame, uint32_t begin,
+                         uint32_t end);
+
+// RangeTaskFunc taking a SphereFrame, for writeSphereSortKeys.
+void writeSphereSortKeyRange(void *pData, uint32_t begin, uint32_t end);
+
+// Writes instance slots [begin, end) of frame.pInstances from the spheres in
+// the same slots of frame.pSortSpheres, with streaming stores.
+void writeSortedSphereInstances(const SphereFrame &frame, uint32_t begin,
+                                uint32_t end);
+
+// RangeTaskFunc taking a SphereFrame, for writeSortedSphereInstances. The
+// range is over instance slots, not spheres.
+void writeSortedSphereFrameRange(void *pData, uint32_t begin, uint32_t end);
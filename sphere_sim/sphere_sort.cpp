@@ -0,0 +1,118 @@
+#include "sphere_sort.h"
+
+#include <cstring>
+
+#include <OS/Interfaces/IMemory.h>
+
+RadixSortScratch allocRadixSortScratch(uint32_t count) {
+  RadixSortScratch scratch;
+  scratch.pKeys = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  scratch.pValues = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  scratch.pHistograms =
+      (uint32_t *)tf_malloc(radixSortHistogramSize(count) * sizeof(uint32_t));
+  return scratch;
+}
+
+void freeRadixSortScratch(const RadixSortScratch &scratch) {
+  tf_free(scratch.pKeys);
+  tf_free(scratch.pValues);
+  tf_free(scratch.pHistograms);
+}
+
+struct RadixSortPass {
+  const uint32_t *pSrcKeys;
+  const uint32_t *pSrcValues;
+  uint32_t *pDstKeys;
+  uint32_t *pDstValues;
+  // gRadixSortBuckets entries per chunk: digit counts after the count step,
+  // the chunk's first slot for each digit after the prefix sum.
+  uint32_t *pHistograms;
+  uint32_t mShift;
+};
+
+static void countDigitsRange(void *pData, uint32_t begin, uint32_t end) {
+  auto pPass = static_cast<const RadixSortPass *>(pData);
+  uint32_t *pCounts = pPass->pHistograms +
+                      begin / gRadixSortGrainSize * gRadixSortBuckets;
+  memset(pCounts, 0, gRadixSortBuckets * sizeof(uint32_t));
+  for (uint32_t i = begin; i < end; ++i)
+    ++pCounts[(pPass->pSrcKeys[i] >> pPass->mShift) & (gRadixSortBuckets - 1)];
+}
+
+static void scatterDigitsRange(void *pData, uint32_t begin, uint32_t end) {
+  auto pPass = static_cast<const RadixSortPass *>(pData);
+  uint32_t offset[gRadixSortBuckets];
+  memcpy(offset,
+         pPass->pHistograms + begin / gRadixSortGrainSize * gRadixSortBuckets,
+         sizeof(offset));
+  for (uint32_t i = begin; i < end; ++i) {
+    const uint32_t key = pPass->pSrcKeys[i];
+    const uint32_t slot =
+        offset[(key >> pPass->mShift) & (gRadixSortBuckets - 1)]++;
+    pPass->pDstKeys[slot] = key;
+    pPass->pDstValues[slot] = pPass->pSrcValues[i];
+  }
+}
+
+void radixSortPairs(ThreadSystem *pThreads, uint32_t *pKeys, uint32_t *pValues,
+                    uint32_t count, uint32_t keyBits,
+                    const RadixSortScratch &scratch, uint32_t maxThreads) {
+  if (count < 2)
+    return;
+
+  const uint32_t chunkCount =
+      (count + gRadixSortGrainSize - 1) / gRadixSortGrainSize;
+  RadixSortPass pass = {pKeys, pValues, scratch.pKeys, scratch.pValues,
+                        scratch.pHistograms, 0};
+  for (; pass.mShift < keyBits; pass.mShift += gRadixSortBits) {
+    parallelFor(pThreads, countDigitsRange, &pass, count, gRadixSortGrainSize,
+                maxThreads);
+
+    // Digit-major prefix sum, so pairs with the same digit keep their chunk
+    // order and the sort stays stable.
+    uint32_t slot = 0;
+    bool oneDigit = false;
+    for (uint32_t d = 0; d < gRadixSortBuckets; ++d) {
+      const uint32_t digitBegin = slot;
+      for (uint32_t c = 0; c < chunkCount; ++c) {
+        uint32_t &entry = pass.pHistograms[c * gRadixSortBuckets + d];
+        const uint32_t chunkDigitCount = entry;
+        entry = slot;
+        slot += chunkDigitCount;
+      }
+      if (slot - digitBegin == count) {
+        oneDigit = true;
+        break;
+      }
+    }
+    // Every key has the same digit, so the pairs are already in order.
+    if (oneDigit)
+      continue;
+
+    parallelFor(pThreads, scatterDigitsRange, &pass, count,
+                gRadixSortGrainSize, maxThreads);
+    uint32_t *pOldSrcKeys = (uint32_t *)pass.pSrcKeys;
+    uint32_t *pOldSrcValues = (uint32_t *)pass.pSrcValues;
+    pass.pSrcKeys = pass.pDstKeys;
+    pass.pSrcValues = pass.pDstValues;
+    pass.pDstKeys = pOldSrcKeys;
+    pass.pDstValues = pOldSrcValues;
+  }
+
+  if (pass.pSrcKeys != pKeys) {
+    memcpy(pKeys, pass.pSrcKeys, count * sizeof(uint32_t));
+    memcpy(pValues, pass.pSrcValues, count * sizeof(uint32_t));
+  }
+}
+
+void sortVisibleSpheres(ThreadSystem *pThreads, const SphereFrame &frame,
+                        const uint32_t *pLodVisibleCount,
+                        const uint32_t *pLodInstanceOffset,
+                        const RadixSortScratch &scratch, uint32_t maxThreads) {
+  for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+    const uint32_t offset = pLodInstanceOffset[l];
+    radixSortPairs(pThreads, frame.pSortKeys + offset,
+                   frame.pSortSpheres + offset, pLodVisibleCount[l],
+                   gSphereSortKeyBits, scratch, maxThreads);
+  }
+}
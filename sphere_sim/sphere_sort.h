@@ -0,0 +1,44 @@
+#pragma once
+
+// Parallel LSD radix sort of (key, value) pairs, used to order the visible
+// spheres front to back so early depth testing rejects the hidden ones.
+
+#include "sphere_sim.h"
+
+constexpr uint32_t gRadixSortBits = 8;
+constexpr uint32_t gRadixSortBuckets = 1u << gRadixSortBits;
+// Pairs each parallelFor chunk of a pass counts and scatters.
+constexpr uint32_t gRadixSortGrainSize = 16 * 1024;
+
+// Working memory for sorting up to a given number of pairs.
+struct RadixSortScratch {
+  uint32_t *pKeys;
+  uint32_t *pValues;
+  // radixSortHistogramSize entries.
+  uint32_t *pHistograms;
+};
+
+inline uint32_t radixSortHistogramSize(uint32_t count) {
+  return (count + gRadixSortGrainSize - 1) / gRadixSortGrainSize *
+         gRadixSortBuckets;
+}
+
+RadixSortScratch allocRadixSortScratch(uint32_t count);
+void freeRadixSortScratch(const RadixSortScratch &scratch);
+
+// Stable sort of count pairs by the low keyBits bits of their keys, one
+// gRadixSortBits digit per pass. Each pass counts and then scatters on the
+// ThreadSystem, and passes where every key has the same digit are skipped.
+// The sorted pairs end up back in pKeys and pValues.
+void radixSortPairs(ThreadSystem *pThreads, uint32_t *pKeys, uint32_t *pValues,
+                    uint32_t count, uint32_t keyBits,
+                    const RadixSortScratch &scratch,
+                    uint32_t maxThreads = gMaxParallelForThreads);
+
+// Sorts each LOD's range of frame.pSortKeys and frame.pSortSpheres, as laid
+// out by countVisibleSpheres, nearest first.
+void sortVisibleSpheres(ThreadSystem *pThreads, const SphereFrame &frame,
+                        const uint32_t *pLodVisibleCount,
+                        const uint32_t *pLodInstanceOffset,
+                        const RadixSortScratch &scratch,
+                        uint32_t maxThreads = gMaxParallelForThreads);
@@ -0,0 +1,588 @@
+// Correctness checks for sphere_sim, no renderer or GPU needed: the SIMD
+// kernels against the scalar ones, floatToHalf against an exact reference,
+// culling, LOD selection and instance packing against plain scalar versions,
+// the radix sort against std::stable_sort and the grid queries against testing
+// every sphere. Prints one line per check and exits with 1 if any of them
+// fails.
+//
+// sphere_test
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <OS/Interfaces/IMemory.h>
+#include <OS/Interfaces/IThread.h>
+
+#include <OS/Core/ThreadSystem.h>
+
+#include "sphere_grid.h"
+#include "sphere_sim.h"
+#include "sphere_sort.h"
+
+constexpr uint32_t gTestSeed = 0x5eed;
+constexpr float gTestDeltaZ = 500.0f / 60.0f;
+// Enough frames for every sphere to be respawned a few times.
+constexpr uint32_t gTestFrameCount = 1000;
+
+static uint32_t gFailureCount = 0;
+
+static void check(bool passed, const char *pName) {
+  printf("%-48s %s\n", pName, passed ? "ok" : "FAILED");
+  if (!passed)
+    ++gFailureCount;
+}
+
+// xorshift32, so the inputs are the same on every run.
+static uint32_t nextRandom(uint32_t &state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static SphereState spawnTestState(uint32_t count) {
+  SphereState state = allocSphereState(count);
+  SphereSpawn spawn = {state, 0, gTestSeed, 0};
+  spawnSphereRange(&spawn, 0, count);
+  return state;
+}
+
+static void testUpdateKernels() {
+  // Not a multiple of the block size or of the SIMD width, so the tails of
+  // both are covered.
+  const uint32_t count = 10 * gSphereBlockSize + 13;
+  SphereState state = spawnTestState(count);
+  check(sphereKernelsMatch(state, count, gTestDeltaZ, gTestSeed,
+                           gTestFrameCount),
+        "updateSpheres SIMD matches scalar");
+
+  // updateSpheresInto, used by the pipelined step, against in place updates.
+  SphereState inPlace = allocSphereState(count);
+  SphereState src = allocSphereState(count);
+  SphereState dst = allocSphereState(count);
+  copySphereState(inPlace, state, count);
+  copySphereState(src, state, count);
+  bool match = true;
+  for (uint32_t frame = 0; frame < gTestFrameCount && match; ++frame) {
+    updateSpheres(inPlace, 0, count, gTestDeltaZ, gTestSeed, frame, true);
+    updateSpheresInto(dst, src, 0, count, gTestDeltaZ, gTestSeed, frame, true);
+    match = equalSphereState(inPlace, dst, count);
+    const SphereState swap = src;
+    src = dst;
+    dst = swap;
+  }
+  check(match, "updateSpheresInto matches updateSpheres");
+
+  freeSphereState(inPlace);
+  freeSphereState(src);
+  freeSphereState(dst);
+  freeSphereState(state);
+}
+
+// Round to nearest even in double precision, which holds every half and
+// every float exactly.
+static uint16_t referenceHalf(float f) {
+  const uint16_t sign = std::signbit(f) ? 0x8000 : 0;
+  const double value = fabs((double)f);
+  if (std::isinf(f) || value >= 65520.0)
+    return sign | 0x7c00;
+  if (value < ldexp(1.0, -14))
+    return sign | (uint16_t)nearbyint(ldexp(value, 24));
+  int exponent;
+  frexp(value, &exponent);
+  // From 1024 to 2048, where 2048 carries into the exponent.
+  const uint32_t significand = (uint32_t)nearbyint(ldexp(value, 11 - exponent));
+  return sign | (uint16_t)(((exponent + 14) << 10) + significand - 1024);
+}
+
+static bool halvesMatch(const float *pValues) {
+  uint32_t halves[4];
+  _mm_storeu_si128((__m128i *)halves, floatToHalf(_mm_loadu_ps(pValues)));
+  for (uint32_t i = 0; i < 4; ++i) {
+    if (halves[i] != referenceHalf(pValues[i])) {
+      printf("  floatToHalf(%.9g) = 0x%04x, expected 0x%04x\n", pValues[i],
+             halves[i], referenceHalf(pValues[i]));
+      return false;
+    }
+  }
+  return true;
+}
+
+static void testFloatToHalf() {
+  // Zeros, the subnormal and overflow boundaries, and ties on either side.
+  const float edges[] = {0.0f,          -0.0f,        5.9604645e-8f,
+                         2.9802322e-8f, 2.9802326e-8f, 6.1035156e-5f,
+                         6.1032665e-5f, 1.0f,         1.00048828125f,
+                         1.00146484375f, 65504.0f,    65519.996f,
+                         65520.0f,      -65520.0f,    1.0e10f,
+                         INFINITY,      -INFINITY,    gHalfMax};
+  bool match = true;
+  for (size_t i = 0; i + 4 <= sizeof(edges) / sizeof(edges[0]); i += 4)
+    match = match && halvesMatch(edges + i);
+  const float tail[4] = {edges[16], edges[17], 0.0f, 0.0f};
+  match = match && halvesMatch(tail);
+  check(match, "floatToHalf edge cases");
+
+  // Every finite float in steps of a prime number of bit patterns.
+  match = true;
+  float values[4];
+  uint32_t lane = 0;
+  for (uint64_t bits = 0; bits < 0x100000000ull && match; bits += 251) {
+    if (((uint32_t)bits & 0x7f800000) == 0x7f800000)
+      continue;
+    const uint32_t pattern = (uint32_t)bits;
+    memcpy(&values[lane], &pattern, sizeof(float));
+    if (++lane == 4) {
+      match = halvesMatch(values);
+      lane = 0;
+    }
+  }
+  check(match, "floatToHalf matches round to nearest even");
+}
+
+// Looks down +z with a 90 degree field of view both ways. The far plane cuts
+// through the spawn ball, so some spheres are culled by every plane.
+static Frustum makeTestFrustum() {
+  const float s = sqrtf(0.5f);
+  const Frustum frustum = {{{s, 0.0f, s, 0.0f},
+                            {-s, 0.0f, s, 0.0f},
+                            {0.0f, s, s, 0.0f},
+                            {0.0f, -s, s, 0.0f},
+                            {0.0f, 0.0f, -1.0f, 800.0f},
+                            {0.0f, 0.0f, 1.0f, -0.3f}}};
+  return frustum;
+}
+
+// View depth is z.
+static mat4 makeTestProjView() {
+  mat4 projView = mat4::identity();
+  projView.setRow(3, vec4(0.0f, 0.0f, 1.0f, 0.0f));
+  return projView;
+}
+
+// Distance of the sphere surface past the plane it is furthest outside of,
+// negative if it touches the frustum, in double precision.
+static double frustumExcess(const Frustum &frustum, float x, float y, float z,
+                            float radius) {
+  double excess = -DBL_MAX;
+  for (uint32_t p = 0; p < 6; ++p) {
+    const float *plane = frustum.mPlanes[p];
+    const double distance = (double)plane[0] * x + (double)plane[1] * y +
+                            (double)plane[2] * z + plane[3];
+    excess = std::max(excess, -distance - radius);
+  }
+  return excess;
+}
+
+static void testCulling() {
+  const uint32_t count = 20 * gSphereBlockSize + 13;
+  SphereState state = spawnTestState(count);
+  const Frustum frustum = makeTestFrustum();
+
+  // cullSpheres against the plane test in double precision. Spheres within
+  // rounding of a plane may go either way.
+  uint32_t *pVisible = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  const uint32_t visibleCount =
+      cullSpheres(state, 0, count, frustum, gSphereRadius, pVisible);
+  bool match = true;
+  uint32_t listed = 0;
+  for (uint32_t i = 0; i < count && match; ++i) {
+    const double excess = frustumExcess(frustum, state.pX[i], state.pY[i],
+                                        state.pZ[i], gSphereRadius);
+    const bool visible = listed < visibleCount && pVisible[listed] == i;
+    if (visible)
+      ++listed;
+    if (fabs(excess) > 1.0e-3)
+      match = visible == (excess < 0.0);
+  }
+  match = match && listed == visibleCount && visibleCount > 0 &&
+          visibleCount < count;
+  check(match, "cullSpheres matches the scalar plane test");
+
+  // classifySpheres: culled spheres get gSphereLodCount, visible ones the LOD
+  // of their depth, and the block counts add up.
+  const uint32_t blockCount = sphereBlockCount(count);
+  SphereFrame frame = {};
+  frame.mState = state;
+  frame.pSphereLod = (uint8_t *)tf_malloc(count);
+  frame.pBlockLodCount =
+      (uint32_t *)tf_calloc(blockCount * gSphereLodCount, sizeof(uint32_t));
+  frame.pSphereDepth = (uint16_t *)tf_malloc(count * sizeof(uint16_t));
+  frame.mCull = true;
+  frame.mFrustum = frustum;
+  // The spawn ball starts at depth 500. Mesh LODs switch at depth 600 and
+  // 1800, impostors from 750.
+  frame.mLodSelection = makeLodSelection(makeTestProjView(), 7200.0f, 750.0f);
+  classifySpheres(frame, 0, count);
+
+  match = true;
+  uint32_t blockLodCount[gSphereLodCount] = {};
+  uint32_t lodSeen[gSphereLodCount + 1] = {};
+  for (uint32_t i = 0; i < count && match; ++i) {
+    uint32_t lod = gSphereLodCount;
+    if (sphereInFrustum(frustum, state.pX[i], state.pY[i], state.pZ[i],
+                        gSphereRadius)) {
+      const float z = state.pZ[i];
+      lod = z > 750.0f ? gSphereImpostorLod : (z > 600.0f ? 1 : 0);
+      ++blockLodCount[lod];
+      match = frame.pSphereDepth[i] == sphereSortKey(z);
+    }
+    match = match && frame.pSphereLod[i] == lod;
+    ++lodSeen[lod];
+    if (i % gSphereBlockSize == gSphereBlockSize - 1 || i + 1 == count) {
+      const uint32_t *pCount =
+          frame.pBlockLodCount + i / gSphereBlockSize * gSphereLodCount;
+      for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+        match = match && pCount[l] == blockLodCount[l];
+        blockLodCount[l] = 0;
+      }
+    }
+  }
+  // The test frustum must reach every LOD used, and culling.
+  match = match && lodSeen[0] > 0 && lodSeen[1] > 0 &&
+          lodSeen[gSphereImpostorLod] > 0 && lodSeen[gSphereLodCount] > 0;
+  check(match, "classifySpheres matches per sphere LOD selection");
+
+  tf_free(frame.pSphereLod);
+  tf_free(frame.pBlockLodCount);
+  tf_free(frame.pSphereDepth);
+  tf_free(pVisible);
+  freeSphereState(state);
+}
+
+static void testLodSelection() {
+  const float pixelsPerUnit = 600.0f;
+  const float switchDepth[2] = {2.0f * gSphereRadius * pixelsPerUnit / 24.0f,
+                                2.0f * gSphereRadius * pixelsPerUnit / 8.0f};
+  const mat4 projView = makeTestProjView();
+
+  // Without impostors the coarsest mesh LOD has no far limit.
+  LodSelection selection = makeLodSelection(projView, pixelsPerUnit);
+  bool match = selection.mDepthRow[0] == 0.0f &&
+               selection.mDepthRow[1] == 0.0f &&
+               selection.mDepthRow[2] == 1.0f &&
+               selection.mDepthRow[3] == 0.0f &&
+               selection.mMaxDepth[0] == switchDepth[0] &&
+               selection.mMaxDepth[1] == switchDepth[1] &&
+               selection.mMaxDepth[2] == FLT_MAX;
+  // A sphere exactly at a switch depth keeps the finer LOD.
+  for (uint32_t l = 0; l < 2; ++l) {
+    match = match && selectLodAtDepth(selection, switchDepth[l]) == l &&
+            selectLodAtDepth(selection, nextafterf(switchDepth[l], FLT_MAX)) ==
+                l + 1;
+  }
+  match = match && selectLodAtDepth(selection, 1.0e30f) == 2 &&
+          selectLod(selection, 5.0f, -5.0f, switchDepth[0]) == 0;
+  check(match, "makeLodSelection switch depths");
+
+  // Impostors beyond the last mesh switch only replace the coarsest LOD.
+  const float farImpostors = 2.0f * switchDepth[1];
+  selection = makeLodSelection(projView, pixelsPerUnit, farImpostors);
+  match = selection.mMaxDepth[0] == switchDepth[0] &&
+          selection.mMaxDepth[1] == switchDepth[1] &&
+          selection.mMaxDepth[2] == farImpostors &&
+          selectLodAtDepth(selection, farImpostors) == 2 &&
+          selectLodAtDepth(selection, nextafterf(farImpostors, FLT_MAX)) ==
+              gSphereImpostorLod;
+  // Nearer than the first switch, every mesh LOD is clamped away.
+  const float nearImpostors = 0.5f * switchDepth[0];
+  selection = makeLodSelection(projView, pixelsPerUnit, nearImpostors);
+  for (uint32_t l = 0; l < 4; ++l)
+    match = match && selection.mMaxDepth[l] == nearImpostors;
+  match = match && selectLodAtDepth(selection, nearImpostors) == 0 &&
+          selectLodAtDepth(selection, nextafterf(nearImpostors, FLT_MAX)) ==
+              gSphereImpostorLod;
+  check(match, "makeLodSelection clamps to the impostor depth");
+}
+
+static void testCountVisibleSpheres() {
+  const uint32_t count = 37 * gSphereBlockSize + 5;
+  const uint32_t blockCount = sphereBlockCount(count);
+  uint32_t *pBlockLodCount =
+      (uint32_t *)tf_malloc(blockCount * gSphereLodCount * sizeof(uint32_t));
+  uint32_t *pBlockLodOffset =
+      (uint32_t *)tf_malloc(blockCount * gSphereLodCount * sizeof(uint32_t));
+  uint32_t random = gTestSeed;
+  for (uint32_t b = 0; b < blockCount; ++b) {
+    // Some blocks fully culled, some with a single LOD.
+    uint32_t left = nextRandom(random) % 4 == 0 ? 0 : gSphereBlockSize;
+    for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+      const uint32_t n = l + 1 < gSphereLodCount
+                             ? nextRandom(random) % (left + 1)
+                             : left;
+      pBlockLodCount[b * gSphereLodCount + l] = n;
+      left -= n;
+    }
+  }
+
+  uint32_t lodVisible[gSphereLodCount];
+  uint32_t lodOffset[gSphereLodCount];
+  const uint32_t visibleCount = countVisibleSpheres(
+      pBlockLodCount, count, lodVisible, lodOffset, pBlockLodOffset);
+
+  // LODs back to back, and each block's spheres of a LOD right after the
+  // previous block's.
+  bool match = true;
+  uint32_t total = 0;
+  for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+    uint32_t lodTotal = 0;
+    for (uint32_t b = 0; b < blockCount; ++b) {
+      match = match &&
+              pBlockLodOffset[b * gSphereLodCount + l] == total + lodTotal;
+      lodTotal += pBlockLodCount[b * gSphereLodCount + l];
+    }
+    match = match && lodOffset[l] == total && lodVisible[l] == lodTotal;
+    total += lodTotal;
+  }
+  match = match && visibleCount == total;
+  check(match, "countVisibleSpheres matches prefix sums");
+
+  tf_free(pBlockLodCount);
+  tf_free(pBlockLodOffset);
+}
+
+static SphereInstance referenceInstance(const SphereState &state, uint32_t i,
+                                        const float3 &origin) {
+  auto half = [](float offset) {
+    offset = offset < -gHalfMax ? -gHalfMax : offset;
+    offset = offset > gHalfMax ? gHalfMax : offset;
+    return (uint32_t)referenceHalf(offset);
+  };
+  SphereInstance instance;
+  instance.mPositionXY =
+      half(state.pX[i] - origin.x) | half(state.pY[i] - origin.y) << 16;
+  instance.mPositionZ = half(state.pZ[i] - origin.z);
+  instance.mColor = state.pColor[i];
+  return instance;
+}
+
+static bool instancesEqual(const SphereInstance &a, const SphereInstance &b) {
+  return a.mPositionXY == b.mPositionXY && a.mPositionZ == b.mPositionZ &&
+         a.mColor == b.mColor;
+}
+
+static void testWriteInstances() {
+  const uint32_t count = 12 * gSphereBlockSize + 29;
+  const uint32_t blockCount = sphereBlockCount(count);
+  SphereState state = spawnTestState(count);
+  // Offsets past the largest half, which are clamped.
+  state.pX[3] = 1.0e6f;
+  state.pY[4] = -1.0e6f;
+  state.pZ[5] = 70000.0f;
+
+  SphereFrame frame = {};
+  frame.mState = state;
+  frame.pSphereLod = (uint8_t *)tf_malloc(count);
+  frame.pBlockLodCount =
+      (uint32_t *)tf_calloc(blockCount * gSphereLodCount, sizeof(uint32_t));
+  frame.pBlockLodOffset =
+      (uint32_t *)tf_calloc(blockCount * gSphereLodCount, sizeof(uint32_t));
+  frame.pInstances =
+      (SphereInstance *)tf_malloc(count * sizeof(SphereInstance));
+  frame.pSortSpheres = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  frame.mLodSelection = makeLodSelection(makeTestProjView(), 7200.0f, 750.0f);
+  frame.mInstanceOrigin = float3(10.0f, -20.0f, 30.0f);
+  // The clamped spheres are outside any useful frustum, so cull nothing.
+  frame.mCull = false;
+  classifySpheres(frame, 0, count);
+  uint32_t lodVisible[gSphereLodCount];
+  uint32_t lodOffset[gSphereLodCount];
+  const uint32_t visibleCount =
+      countVisibleSpheres(frame.pBlockLodCount, count, lodVisible, lodOffset,
+                          frame.pBlockLodOffset);
+  writeSphereInstances(frame, 0, count);
+
+  // LOD by LOD, in sphere order within each.
+  bool match = visibleCount == count;
+  uint32_t slot = 0;
+  for (uint32_t l = 0; l < gSphereLodCount; ++l) {
+    for (uint32_t i = 0; i < count && match; ++i) {
+      if (frame.pSphereLod[i] != l)
+        continue;
+      match = instancesEqual(frame.pInstances[slot++],
+                             referenceInstance(state, i, frame.mInstanceOrigin));
+    }
+  }
+  check(match && slot == visibleCount,
+        "writeSphereInstances matches the scalar packing");
+
+  // Any order of spheres, here a stride through all of them.
+  for (uint32_t s = 0; s < count; ++s)
+    frame.pSortSpheres[s] = (uint32_t)((uint64_t)s * 7919 % count);
+  writeSortedSphereInstances(frame, 0, count);
+  match = true;
+  for (uint32_t s = 0; s < count && match; ++s) {
+    match = instancesEqual(frame.pInstances[s],
+                           referenceInstance(state, frame.pSortSpheres[s],
+                                             frame.mInstanceOrigin));
+  }
+  check(match, "writeSortedSphereInstances follows pSortSpheres");
+
+  tf_free(frame.pSphereLod);
+  tf_free(frame.pBlockLodCount);
+  tf_free(frame.pBlockLodOffset);
+  tf_free(frame.pInstances);
+  tf_free(frame.pSortSpheres);
+  freeSphereState(state);
+}
+
+static bool radixSortMatches(ThreadSystem *pThreads, uint32_t count,
+                             uint32_t keyBits, uint32_t keyMask,
+                             uint32_t &random) {
+  uint32_t *pKeys = (uint32_t *)tf_malloc((count + 1) * sizeof(uint32_t));
+  uint32_t *pValues = (uint32_t *)tf_malloc((count + 1) * sizeof(uint32_t));
+  uint64_t *pPairs = (uint64_t *)tf_malloc((count + 1) * sizeof(uint64_t));
+  for (uint32_t i = 0; i < count; ++i) {
+    pKeys[i] = nextRandom(random) & keyMask;
+    pValues[i] = i;
+    pPairs[i] = (uint64_t)pKeys[i] << 32 | i;
+  }
+  std::stable_sort(pPairs, pPairs + count, [](uint64_t a, uint64_t b) {
+    return (a >> 32) < (b >> 32);
+  });
+
+  RadixSortScratch scratch = allocRadixSortScratch(count);
+  radixSortPairs(pThreads, pKeys, pValues, count, keyBits, scratch);
+  freeRadixSortScratch(scratch);
+
+  bool match = true;
+  for (uint32_t i = 0; i < count && match; ++i)
+    match = pKeys[i] == (uint32_t)(pPairs[i] >> 32) &&
+            pValues[i] == (uint32_t)pPairs[i];
+
+  tf_free(pKeys);
+  tf_free(pValues);
+  tf_free(pPairs);
+  return match;
+}
+
+static void testRadixSort(ThreadSystem *pThreads) {
+  const uint32_t counts[] = {0, 1, 2, 1000, gRadixSortGrainSize + 7,
+                             5 * gRadixSortGrainSize + 3};
+  uint32_t random = gTestSeed;
+  bool match = true;
+  for (uint32_t count : counts) {
+    match = match && radixSortMatches(pThreads, count, 16, 0xffff, random);
+    match = match && radixSortMatches(pThreads, count, 32, ~0u, random);
+    // Few distinct keys, so most pairs tie and stability matters.
+    match = match && radixSortMatches(pThreads, count, 16, 0x0303, random);
+    // One key, so every pass is skipped.
+    match = match && radixSortMatches(pThreads, count, 16, 0, random);
+  }
+  check(match, "radixSortPairs matches std::stable_sort");
+}
+
+// Looks down +z with a field of view of twice halfAngle both ways, from
+// (0, y, 0).
+static Frustum makeNarrowFrustum(float halfAngle, float y) {
+  const float c = cosf(halfAngle);
+  const float s = sinf(halfAngle);
+  const Frustum frustum = {{{c, 0.0f, s, 0.0f},
+                            {-c, 0.0f, s, 0.0f},
+                            {0.0f, c, s, -c * y},
+                            {0.0f, -c, s, c * y},
+                            {0.0f, 0.0f, -1.0f, 2000.0f},
+                            {0.0f, 0.0f, 1.0f, -0.3f}}};
+  return frustum;
+}
+
+// A grid built from a state stepped long enough to spread the respawns over
+// the z ring, against testing every sphere.
+static void testGridQueries() {
+  const uint32_t count = 64 * gSphereBlockSize + 13;
+  SphereState state = spawnTestState(count);
+  for (uint32_t f = 1; f <= gTestFrameCount / 4; ++f)
+    updateSpheres(state, 0, count, gTestDeltaZ, gTestSeed, f, true);
+  SphereGrid grid = {};
+  initSphereGrid(grid, state, count);
+
+  uint32_t listed = 0;
+  bool match = true;
+  for (uint32_t c = 0; c < gGridCellCount && match; ++c) {
+    const SphereGridCell &cell = grid.pCells[c];
+    for (uint32_t s = 0; s < cell.mCount && match; ++s) {
+      const uint32_t i = cell.pSpheres[s];
+      match = i < count &&
+              sphereGridCell(state.pX[i], state.pY[i], state.pZ[i]) == c;
+    }
+    listed += cell.mCount;
+  }
+  check(match && listed == count, "grid lists every sphere in its cell");
+
+  // The wide frustum leaves most slices partly visible, the narrow ones
+  // reject whole rows, one of them above the spawn ball's axis.
+  const Frustum frusta[] = {makeTestFrustum(), makeNarrowFrustum(0.2f, 0.0f),
+                            makeNarrowFrustum(0.1f, 300.0f)};
+  uint32_t *pGridVisible = (uint32_t *)tf_malloc(count * sizeof(uint32_t));
+  match = true;
+  for (const Frustum &frustum : frusta) {
+    const uint32_t gridCount = queryGridFrustum(grid, state, frustum,
+                                                gSphereRadius, pGridVisible);
+    std::sort(pGridVisible, pGridVisible + gridCount);
+    uint32_t scanCount = 0;
+    for (uint32_t i = 0; i < count && match; ++i) {
+      if (!sphereInFrustum(frustum, state.pX[i], state.pY[i], state.pZ[i],
+                           gSphereRadius))
+        continue;
+      match = scanCount < gridCount && pGridVisible[scanCount] == i;
+      ++scanCount;
+    }
+    match = match && scanCount == gridCount;
+  }
+  tf_free(pGridVisible);
+  check(match, "grid frustum query matches testing every sphere");
+
+  // Rays from the origin and from inside the spawn ball. Odd rays aim at a
+  // sphere, so most of them hit, even ones go anywhere and mostly miss.
+  uint32_t random = gTestSeed;
+  match = true;
+  for (uint32_t r = 0; r < 256 && match; ++r) {
+    const float origin = r < 128 ? 0.0f : 1000.0f;
+    float3 dir(unitFloat(nextRandom(random)) - 0.5f,
+               unitFloat(nextRandom(random)) - 0.5f,
+               unitFloat(nextRandom(random)) - 0.25f);
+    if (r & 1) {
+      const uint32_t target = nextRandom(random) % count;
+      dir = float3(state.pX[target] + 0.5f * dir.x,
+                   state.pY[target] + 0.5f * dir.y,
+                   state.pZ[target] - origin + 0.5f * dir.z);
+    }
+    const float invLength =
+        1.0f / sqrtf(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
+    dir = float3(dir.x * invLength, dir.y * invLength, dir.z * invLength);
+    uint32_t gridSphere = UINT32_MAX, scanSphere = UINT32_MAX;
+    float gridT = 0.0f, scanT = 0.0f;
+    const bool gridHit =
+        queryGridRay(grid, state, float3(0.0f, 0.0f, origin), dir, 4000.0f,
+                     gSphereRadius, &gridSphere, &gridT);
+    const bool scanHit =
+        raycastSpheres(state, count, float3(0.0f, 0.0f, origin), dir, 4000.0f,
+                       gSphereRadius, &scanSphere, &scanT);
+    match = gridHit == scanHit && gridSphere == scanSphere && gridT == scanT;
+  }
+  check(match, "grid ray query matches testing every sphere");
+
+  exitSphereGrid(grid);
+  freeSphereState(state);
+}
+
+int main() {
+  ThreadSystem *pThreadSystem = nullptr;
+  initThreadSystem(&pThreadSystem);
+
+  testUpdateKernels();
+  testFloatToHalf();
+  testCulling();
+  testLodSelection();
+  testCountVisibleSpheres();
+  testWriteInstances();
+  testRadixSort(pThreadSystem);
+  testGridQueries();
+
+  shutdownThreadSystem(pThreadSystem);
+  printf("%u failed\n", gFailureCount);
+  return gFailureCount > 0 ? 1 : 0;
+}